@@ -0,0 +1,683 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "tensor.h"
+#include "matrix.h"
+#include "conv.h"
+#include "random.h"
+#include "sparse.h"
+#include "norm.h"
+#include "unary.h"
+#include "pool.h"
+
+#define MAX_RESULTS 256
+#define MAX_REPS 1000
+
+// Usage: tenswords_bench [-r reps] [-w warmup] [-f filter] [-o out.json]
+//                        [-b baseline.json] [-t threshold]
+// Every benchmark is warmed up, then timed for reps samples. Each sample runs
+// enough iterations to take about a millisecond so timer noise stays small.
+// Results go out as JSON, one benchmark per line. With -b the medians are
+// compared against an earlier run and slowdowns beyond threshold (default
+// 0.10, i.e. 10%) are reported and make the exit status nonzero.
+
+typedef struct bench_result {
+    char name[128];
+    size_t reps;
+    size_t iters;
+    double median;
+    double p95;
+    double min;
+    double flops;
+    double bytes;
+} bench_result;
+
+typedef void (*bench_fn)(void *ctx);
+
+typedef struct bench_config {
+    size_t reps;
+    size_t warmup;
+    const char *filter;
+} bench_config;
+
+static bench_result results[MAX_RESULTS];
+static size_t nresults = 0;
+
+double currtime()
+{
+    struct timeval time;
+    if (gettimeofday(&time,NULL)){
+        return 0;
+    }
+    return (double)time.tv_sec + (double)time.tv_usec * .000001;
+}
+
+int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+void run_bench(bench_config cfg, const char *name, bench_fn fn, void *ctx, double flops, double bytes)
+{
+    static double samples[MAX_REPS];
+    size_t i, j;
+    if(cfg.filter && !strstr(name, cfg.filter)) return;
+    if(nresults == MAX_RESULTS) return;
+
+    // Warmup also sizes the inner loop
+    double start = currtime();
+    for(i = 0; i < cfg.warmup; ++i) fn(ctx);
+    double per = (currtime() - start) / (cfg.warmup ? cfg.warmup : 1);
+    size_t iters = (per > 0 && per < .001) ? (size_t)(.001 / per) + 1 : 1;
+
+    size_t reps = cfg.reps < MAX_REPS ? cfg.reps : MAX_REPS;
+    for(i = 0; i < reps; ++i){
+        start = currtime();
+        for(j = 0; j < iters; ++j) fn(ctx);
+        samples[i] = (currtime() - start) / iters;
+    }
+    qsort(samples, reps, sizeof(double), compare_double);
+
+    bench_result *r = &results[nresults++];
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    r->reps = reps;
+    r->iters = iters;
+    r->median = samples[reps/2];
+    r->p95 = samples[(size_t)ceil(.95*reps) - 1];
+    r->min = samples[0];
+    r->flops = flops;
+    r->bytes = bytes;
+    fprintf(stderr, "%-40s median %10.3f ms  p95 %10.3f ms  %8.3f gflops  %8.3f GB/s\n",
+            r->name, r->median*1000, r->p95*1000,
+            r->flops/r->median/1e9, r->bytes/r->median/1e9);
+}
+
+void write_json(FILE *fp)
+{
+    size_t i;
+    fprintf(fp, "{\"benchmarks\": [\n");
+    for(i = 0; i < nresults; ++i){
+        bench_result r = results[i];
+        fprintf(fp, "{\"name\": \"%s\", \"reps\": %zu, \"iters\": %zu, "
+                "\"median_s\": %.9g, \"p95_s\": %.9g, \"min_s\": %.9g, "
+                "\"flops\": %.17g, \"bytes\": %.17g, \"gflops\": %.6g, \"gbps\": %.6g}%s\n",
+                r.name, r.reps, r.iters, r.median, r.p95, r.min, r.flops, r.bytes,
+                r.flops/r.median/1e9, r.bytes/r.median/1e9, i+1 < nresults ? "," : "");
+    }
+    fprintf(fp, "]}\n");
+}
+
+// Reads the median of every benchmark from a file written by write_json and
+// returns the number of regressions beyond threshold.
+int compare_baseline(const char *path, double threshold)
+{
+    FILE *fp = fopen(path, "r");
+    if(!fp){
+        fprintf(stderr, "Couldn't open baseline %s\n", path);
+        return 1;
+    }
+    char line[1024];
+    int regressions = 0;
+    size_t i;
+    while(fgets(line, sizeof(line), fp)){
+        char name[128];
+        double median;
+        char *m = strstr(line, "\"median_s\": ");
+        if(sscanf(line, "{\"name\": \"%127[^\"]\"", name) != 1 || !m) continue;
+        if(sscanf(m, "\"median_s\": %lf", &median) != 1) continue;
+        for(i = 0; i < nresults; ++i){
+            if(strcmp(results[i].name, name)) continue;
+            double change = results[i].median / median - 1;
+            if(change > threshold){
+                fprintf(stderr, "REGRESSION %-40s %10.3f ms -> %10.3f ms (%+.1f%%)\n",
+                        name, median*1000, results[i].median*1000, change*100);
+                ++regressions;
+            }
+        }
+    }
+    fclose(fp);
+    return regressions;
+}
+
+typedef struct binary_ctx {
+    tensor a;
+    tensor b;
+    tensor (*op)(tensor, tensor);
+} binary_ctx;
+
+void bench_binary(void *ctx)
+{
+    binary_ctx *c = ctx;
+    tensor t = c->op(c->a, c->b);
+    tensor_free(t);
+}
+
+typedef struct unary_ctx {
+    tensor a;
+    tensor (*op)(tensor);
+} unary_ctx;
+
+void bench_unary(void *ctx)
+{
+    unary_ctx *c = ctx;
+    tensor t = c->op(c->a);
+    tensor_free(t);
+}
+
+typedef struct layernorm_ctx {
+    tensor t;
+    tensor gamma;
+    tensor beta;
+} layernorm_ctx;
+
+void bench_layernorm(void *ctx)
+{
+    layernorm_ctx *c = ctx;
+    tensor t = tensor_layernorm(c->t, c->gamma, c->beta, 1e-5f);
+    tensor_free(t);
+}
+
+void bench_axpy(void *ctx)
+{
+    binary_ctx *c = ctx;
+    tensor t = tensor_axpy(1, c->a, c->b);
+    tensor_free(t);
+}
+
+void bench_transpose(void *ctx)
+{
+    binary_ctx *c = ctx;
+    tensor t = matrix_transpose(c->a);
+    tensor_free(t);
+}
+
+void bench_invert(void *ctx)
+{
+    binary_ctx *c = ctx;
+    tensor t = matrix_invert(c->a);
+    tensor_free(t);
+}
+
+typedef struct conv_ctx {
+    tensor im;
+    tensor filters;
+    size_t stride;
+    size_t pad;
+    conv2d_plan *plan;
+    tensor out;
+    tensor grad;
+    tensor dim;
+    tensor df;
+} conv_ctx;
+
+void bench_im2col(void *ctx)
+{
+    conv_ctx *c = ctx;
+    tensor t = im2col(c->im, c->filters.size[2], c->filters.size[3], c->stride, c->pad);
+    tensor_free(t);
+}
+
+void bench_conv(void *ctx)
+{
+    conv_ctx *c = ctx;
+    tensor t = conv2d(c->im, c->filters, c->stride, c->pad);
+    tensor_free(t);
+}
+
+void bench_conv_plan(void *ctx)
+{
+    conv_ctx *c = ctx;
+    conv2d_plan_execute(c->plan, c->im, &c->out);
+}
+
+void bench_conv_backward_input(void *ctx)
+{
+    conv_ctx *c = ctx;
+    conv2d_plan_backward_input(c->plan, c->grad, &c->dim);
+}
+
+void bench_conv_backward_filter(void *ctx)
+{
+    conv_ctx *c = ctx;
+    conv2d_plan_backward_filter(c->plan, c->im, c->grad, &c->df);
+}
+
+void bench_conv_relu_pool(void *ctx)
+{
+    conv_ctx *c = ctx;
+    tensor t = conv2d(c->im, c->filters, c->stride, c->pad);
+    tensor_unary_inplace(&t, UNARY_RELU);
+    tensor p = pool2d(t, POOL_MAX, 2, 2, 0);
+    tensor_free(t);
+    tensor_free(p);
+}
+
+void bench_conv_act_pool(void *ctx)
+{
+    conv_ctx *c = ctx;
+    tensor t = conv2d_act_pool(c->im, c->filters, c->stride, c->pad,
+            UNARY_RELU, POOL_MAX, 2, 2, 0);
+    tensor_free(t);
+}
+
+void bench_fill_uniform(void *ctx)
+{
+    tensor *t = ctx;
+    tensor_fill_uniform(t, 1, -1, 1);
+}
+
+void bench_fill_normal(void *ctx)
+{
+    tensor *t = ctx;
+    tensor_fill_normal(t, 1, 0, 1);
+}
+
+void bench_fill_truncated_normal(void *ctx)
+{
+    tensor *t = ctx;
+    tensor_fill_truncated_normal(t, 1, 0, 1);
+}
+
+void bench_random(bench_config cfg)
+{
+    tensor t = tensor_vmake(3, 3, 1080, 1920);
+    double len = tensor_len(t);
+    run_bench(cfg, "random/uniform/3x1080x1920", bench_fill_uniform, &t, 0, 4*len);
+    run_bench(cfg, "random/normal/3x1080x1920", bench_fill_normal, &t, 0, 4*len);
+    run_bench(cfg, "random/truncated_normal/3x1080x1920", bench_fill_truncated_normal, &t, 0, 4*len);
+    tensor_free(t);
+}
+
+typedef struct sparse_ctx {
+    csr a;
+    bcsr ba;
+    tensor b;
+} sparse_ctx;
+
+void bench_csr(void *ctx)
+{
+    sparse_ctx *c = ctx;
+    tensor t = csr_matrix_multiply(c->a, c->b);
+    tensor_free(t);
+}
+
+void bench_bcsr(void *ctx)
+{
+    sparse_ctx *c = ctx;
+    tensor t = bcsr_matrix_multiply(c->ba, c->b);
+    tensor_free(t);
+}
+
+void bench_norm(bench_config cfg)
+{
+    struct {
+        const char *name;
+        size_t n;
+        size_t s[3];
+    } shapes[] = {
+        {"64x512", 2, {64, 512}},
+        {"16x4096", 2, {16, 4096}},
+        {"8x128x1024", 3, {8, 128, 1024}},
+    };
+    size_t i;
+    for(i = 0; i < sizeof(shapes)/sizeof(shapes[0]); ++i){
+        char name[128];
+        unary_ctx c = {tensor_random(4, shapes[i].n, shapes[i].s), tensor_softmax};
+        size_t cols = shapes[i].s[shapes[i].n-1];
+        double len = tensor_len(c.a);
+        snprintf(name, sizeof(name), "softmax/%s", shapes[i].name);
+        run_bench(cfg, name, bench_unary, &c, 0, 8.0*len);
+        c.op = tensor_log_softmax;
+        snprintf(name, sizeof(name), "log_softmax/%s", shapes[i].name);
+        run_bench(cfg, name, bench_unary, &c, 0, 8.0*len);
+
+        layernorm_ctx l = {c.a, tensor_random(1, 1, &cols), tensor_random(1, 1, &cols)};
+        snprintf(name, sizeof(name), "layernorm/%s", shapes[i].name);
+        run_bench(cfg, name, bench_layernorm, &l, 0, 8.0*len);
+        tensor_free(l.gamma);
+        tensor_free(l.beta);
+        tensor_free(c.a);
+    }
+}
+
+// 4M elements, large enough to run on every thread
+void bench_activations(bench_config cfg)
+{
+    struct {
+        const char *name;
+        tensor (*op)(tensor);
+    } ops[] = {
+        {"exp", tensor_exp},
+        {"log", tensor_log},
+        {"sqrt", tensor_sqrt},
+        {"tanh", tensor_tanh},
+        {"sigmoid", tensor_sigmoid},
+        {"gelu", tensor_gelu},
+        {"relu", tensor_relu},
+    };
+    size_t s[2] = {1024, 4096};
+    tensor a = tensor_random(4, 2, s);
+    size_t i;
+    // Positive inputs for log and sqrt
+    tensor pos = tensor_exp(a);
+    for(i = 0; i < sizeof(ops)/sizeof(ops[0]); ++i){
+        char name[128];
+        unary_ctx c = {ops[i].op == tensor_log || ops[i].op == tensor_sqrt ? pos : a, ops[i].op};
+        snprintf(name, sizeof(name), "unary/%s", ops[i].name);
+        run_bench(cfg, name, bench_unary, &c, 0, 8.0*tensor_len(a));
+    }
+    tensor_free(pos);
+    tensor_free(a);
+}
+
+// Separate conv2d, relu and 2x2 max pool against the fused operator
+void bench_conv_pool(bench_config cfg)
+{
+    struct {
+        size_t im[3];
+        size_t f[4];
+    } shapes[] = {
+        {{16, 128, 128}, {32, 16, 3, 3}},
+        {{64, 56, 56}, {64, 64, 3, 3}},
+    };
+    size_t i;
+    for(i = 0; i < sizeof(shapes)/sizeof(shapes[0]); ++i){
+        char shape[96], name[128];
+        size_t *s = shapes[i].im, *f = shapes[i].f;
+        conv_ctx c = {tensor_random(1, 3, s), tensor_random(1, 4, f), 1, 1};
+        double flops = 2.0*f[0]*f[1]*f[2]*f[3]*s[1]*s[2];
+        double bytes = 4.0*(s[0]*s[1]*s[2] + f[0]*f[1]*f[2]*f[3] + f[0]*s[1]*s[2]/4);
+        snprintf(shape, sizeof(shape), "%zux%zux%zu*%zux%zux%zux%zu",
+                s[0], s[1], s[2], f[0], f[1], f[2], f[3]);
+        snprintf(name, sizeof(name), "conv_relu_pool/%s", shape);
+        run_bench(cfg, name, bench_conv_relu_pool, &c, flops, bytes);
+        snprintf(name, sizeof(name), "conv2d_act_pool/%s", shape);
+        run_bench(cfg, name, bench_conv_act_pool, &c, flops, bytes);
+        tensor_free(c.im);
+        tensor_free(c.filters);
+    }
+}
+
+void bench_sparse(bench_config cfg)
+{
+    // Pruned 3x3 conv weights times an im2col matrix at 70% and 90% sparsity.
+    // csr gets entries pruned one by one. Unstructured pruning would leave
+    // most 4x1 blocks with some entry, so bcsr gets whole blocks pruned,
+    // scored by their top entry, and the same share of blocks survives.
+    float thresholds[] = {.7, .9};
+    size_t M = 256, K = 2304, N = 1024;
+    size_t sa[2] = {M, K};
+    size_t sb[2] = {K, N};
+    size_t i, r, k;
+    for(i = 0; i < sizeof(thresholds)/sizeof(thresholds[0]); ++i){
+        char name[128];
+        tensor a = tensor_random(1, 2, sa);
+        sparse_ctx c = {csr_from_tensor(a, thresholds[i]), {0}, tensor_random(1, 2, sb)};
+        tensor pruned = tensor_copy(a);
+        float *p = tensor_mutable(&pruned);
+        for(r = 0; r < M; r += 4){
+            for(k = 0; k < K; ++k){
+                if(fabsf(a.data[r*K + k]) > thresholds[i]) continue;
+                p[r*K + k] = p[(r+1)*K + k] = p[(r+2)*K + k] = p[(r+3)*K + k] = 0;
+            }
+        }
+        c.ba = bcsr_from_tensor(pruned, 4, 1, 0);
+        int pct = (int)(100*thresholds[i] + .5);
+        snprintf(name, sizeof(name), "csr/%zux%zux%zu/%d%%", M, K, N, pct);
+        run_bench(cfg, name, bench_csr, &c, 2.0*c.a.nnz*N,
+                4.0*(2*c.a.nnz + K*N + M*N));
+        snprintf(name, sizeof(name), "bcsr4x1/%zux%zux%zu/%d%%", M, K, N, pct);
+        run_bench(cfg, name, bench_bcsr, &c, 2.0*c.ba.nblocks*4*N,
+                4.0*(c.ba.nblocks*5 + K*N + M*N));
+        csr_free(c.a);
+        bcsr_free(c.ba);
+        tensor_free(a);
+        tensor_free(pruned);
+        tensor_free(c.b);
+    }
+}
+
+void bench_gemm(bench_config cfg)
+{
+    size_t shapes[][3] = {{64, 64, 64}, {128, 128, 128}, {256, 256, 256}, {512, 512, 512},
+        {8, 27, 131072}, {256, 2304, 1024}, {1024, 1024, 1}, {1, 1024, 1024}};
+    size_t i;
+    for(i = 0; i < sizeof(shapes)/sizeof(shapes[0]); ++i){
+        size_t M = shapes[i][0], K = shapes[i][1], N = shapes[i][2];
+        char name[128];
+        size_t sa[2] = {M, K};
+        size_t sb[2] = {K, N};
+        binary_ctx c = {tensor_random(1, 2, sa), tensor_random(1, 2, sb), matrix_multiply};
+        snprintf(name, sizeof(name), "gemm/%zux%zux%zu", M, K, N);
+        run_bench(cfg, name, bench_binary, &c, 2.0*M*N*K, 4.0*(M*K + K*N + M*N));
+        tensor_free(c.a);
+        tensor_free(c.b);
+    }
+
+    // Scoring shapes: one query against a matrix, and row-wise pairs
+    size_t sa[2] = {4096, 1024};
+    size_t sx[1] = {1024};
+    binary_ctx g = {tensor_random(1, 2, sa), tensor_random(1, 1, sx), matrix_gemv};
+    run_bench(cfg, "gemv/4096x1024", bench_binary, &g, 2.0*4096*1024, 4.0*(4096*1024 + 1024 + 4096));
+    tensor_free(g.b);
+    g.b = tensor_random(1, 2, sa);
+    g.op = matrix_batch_dot;
+    run_bench(cfg, "batch_dot/4096x1024", bench_binary, &g, 2.0*4096*1024, 4.0*(2*4096*1024 + 4096));
+    tensor_free(g.a);
+    tensor_free(g.b);
+}
+
+typedef struct ooc_ctx {
+    tensor a;
+    tensor b;
+    tensor c;
+    size_t budget;
+} ooc_ctx;
+
+void bench_gemm_ooc_(void *ctx)
+{
+    ooc_ctx *c = ctx;
+    matrix_multiply_ooc(c->a, c->b, &c->c, c->budget);
+}
+
+// File-backed operands and output with a 16 MB working set. The files
+// stay in the page cache at this size, so this times the streaming and
+// packing overhead on top of the in-core kernel rather than the disk.
+void bench_gemm_ooc(bench_config cfg)
+{
+    char pa[] = "/tmp/tenswords_bench_XXXXXX";
+    char pb[] = "/tmp/tenswords_bench_XXXXXX";
+    char pc[] = "/tmp/tenswords_bench_XXXXXX";
+    size_t n = 2048;
+    size_t s[2] = {n, n};
+    close(mkstemp(pa));
+    close(mkstemp(pb));
+    close(mkstemp(pc));
+    tensor a = tensor_random(1, 2, s);
+    ooc_ctx c = {tensor_mmap(pa, 2, s, 1), tensor_mmap(pb, 2, s, 1), tensor_mmap(pc, 2, s, 1), 16 << 20};
+    if(c.a.data && c.b.data && c.c.data){
+        memcpy(c.a.data, a.data, n*n*sizeof(float));
+        memcpy(c.b.data, a.data, n*n*sizeof(float));
+        run_bench(cfg, "gemm_ooc/2048x2048x2048", bench_gemm_ooc_, &c, 2.0*n*n*n, 4.0*3*n*n);
+    }
+    tensor_free(c.a);
+    tensor_free(c.b);
+    tensor_free(c.c);
+    tensor_free(a);
+    unlink(pa);
+    unlink(pb);
+    unlink(pc);
+}
+
+void bench_elementwise(bench_config cfg)
+{
+    struct {
+        const char *name;
+        size_t na, nb;
+        size_t sa[4], sb[4];
+    } shapes[] = {
+        {"512x512+512x512", 2, 2, {512, 512}, {512, 512}},
+        {"512x512+512", 2, 1, {512, 512}, {512}},
+        {"512x128x2x2+512x1x2x1", 4, 4, {512, 128, 2, 2}, {512, 1, 2, 1}},
+        {"512x128x2x2+1", 4, 1, {512, 128, 2, 2}, {1}},
+    };
+    size_t i;
+    for(i = 0; i < sizeof(shapes)/sizeof(shapes[0]); ++i){
+        char name[128];
+        binary_ctx c = {tensor_random(1, shapes[i].na, shapes[i].sa),
+            tensor_random(1, shapes[i].nb, shapes[i].sb), tensor_add};
+        tensor out = tensor_add(c.a, c.b);
+        double len = tensor_len(out);
+        double bytes = 4.0*(tensor_len(c.a) + tensor_len(c.b) + len);
+        tensor_free(out);
+
+        snprintf(name, sizeof(name), "add/%s", shapes[i].name);
+        run_bench(cfg, name, bench_binary, &c, len, bytes);
+        c.op = tensor_mul;
+        snprintf(name, sizeof(name), "mul/%s", shapes[i].name);
+        run_bench(cfg, name, bench_binary, &c, len, bytes);
+        snprintf(name, sizeof(name), "axpy/%s", shapes[i].name);
+        run_bench(cfg, name, bench_axpy, &c, 2*len, bytes);
+        tensor_free(c.a);
+        tensor_free(c.b);
+    }
+}
+
+void bench_matrix(bench_config cfg)
+{
+    size_t sizes[] = {64, 512, 2048};
+    size_t inv[] = {64, 128, 256};
+    size_t i;
+    for(i = 0; i < sizeof(sizes)/sizeof(sizes[0]); ++i){
+        char name[128];
+        size_t n = sizes[i];
+        size_t sa[2] = {n, n};
+        binary_ctx c = {tensor_random(1, 2, sa)};
+        snprintf(name, sizeof(name), "transpose/%zux%zu", n, n);
+        run_bench(cfg, name, bench_transpose, &c, 0, 8.0*n*n);
+        tensor_free(c.a);
+    }
+    for(i = 0; i < sizeof(inv)/sizeof(inv[0]); ++i){
+        char name[128];
+        size_t n = inv[i];
+        size_t sa[2] = {n, n};
+        binary_ctx c = {tensor_random(1, 2, sa)};
+        snprintf(name, sizeof(name), "invert/%zux%zu", n, n);
+        // Gauss-Jordan on the n x 2n augmented matrix
+        run_bench(cfg, name, bench_invert, &c, 2.0*n*n*n, 4.0*(n*n + 2*n*n + n*n));
+        tensor_free(c.a);
+    }
+}
+
+void bench_conv2d(bench_config cfg)
+{
+    struct {
+        size_t im[3];
+        size_t f[4];
+        size_t stride, pad;
+    } shapes[] = {
+        {{3, 32, 32}, {16, 3, 3, 3}, 1, 1},
+        {{3, 512, 256}, {8, 3, 3, 3}, 1, 1},
+        {{3, 1080, 1920}, {16, 3, 3, 3}, 2, 1},
+        {{16, 128, 128}, {32, 16, 3, 3}, 1, 1},
+        {{64, 56, 56}, {64, 64, 1, 1}, 1, 0},
+        {{3, 256, 256}, {8, 3, 7, 7}, 1, 3},
+        {{1, 256, 256}, {1, 1, 15, 15}, 1, 7},
+    };
+    size_t i;
+    for(i = 0; i < sizeof(shapes)/sizeof(shapes[0]); ++i){
+        char shape[96], name[128];
+        size_t *s = shapes[i].im, *f = shapes[i].f;
+        size_t stride = shapes[i].stride, pad = shapes[i].pad;
+        conv_ctx c = {tensor_random(1, 3, s), tensor_random(1, 4, f), stride, pad};
+        double res_h = (s[1] + 2*pad - f[2])/stride + 1;
+        double res_w = (s[2] + 2*pad - f[3])/stride + 1;
+        double rows = f[1]*f[2]*f[3];
+        double im_len = s[0]*s[1]*s[2];
+        snprintf(shape, sizeof(shape), "%zux%zux%zu*%zux%zux%zux%zu/s%zup%zu",
+                s[0], s[1], s[2], f[0], f[1], f[2], f[3], stride, pad);
+
+        snprintf(name, sizeof(name), "im2col/%s", shape);
+        run_bench(cfg, name, bench_im2col, &c, 0, 4.0*(im_len + rows*res_h*res_w));
+        snprintf(name, sizeof(name), "conv2d/%s", shape);
+        run_bench(cfg, name, bench_conv, &c, 2.0*f[0]*rows*res_h*res_w,
+                4.0*(im_len + f[0]*rows + f[0]*res_h*res_w));
+
+        c.plan = conv2d_plan_create(s, f, stride, pad);
+        conv2d_plan_set_filters(c.plan, c.filters);
+        c.out = conv2d_plan_output(c.plan);
+        snprintf(name, sizeof(name), "conv2d_plan/%s", shape);
+        run_bench(cfg, name, bench_conv_plan, &c, 2.0*f[0]*rows*res_h*res_w,
+                4.0*(im_len + f[0]*rows + f[0]*res_h*res_w));
+
+        c.grad = tensor_random(1, 3, c.out.size);
+        c.dim = tensor_make(3, s);
+        c.df = tensor_make(4, f);
+        snprintf(name, sizeof(name), "conv2d_backward_input/%s", shape);
+        run_bench(cfg, name, bench_conv_backward_input, &c, 2.0*f[0]*rows*res_h*res_w,
+                4.0*(im_len + f[0]*rows + f[0]*res_h*res_w));
+        snprintf(name, sizeof(name), "conv2d_backward_filter/%s", shape);
+        run_bench(cfg, name, bench_conv_backward_filter, &c, 2.0*f[0]*rows*res_h*res_w,
+                4.0*(im_len + f[0]*rows + f[0]*res_h*res_w));
+        conv2d_plan_free(c.plan);
+        tensor_free(c.out);
+        tensor_free(c.grad);
+        tensor_free(c.dim);
+        tensor_free(c.df);
+        tensor_free(c.im);
+        tensor_free(c.filters);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    bench_config cfg = {20, 3, 0};
+    const char *out = 0;
+    const char *baseline = 0;
+    double threshold = .10;
+    int i;
+    for(i = 1; i < argc; ++i){
+        if(i + 1 == argc){
+            fprintf(stderr, "Missing value for %s\n", argv[i]);
+            return 1;
+        }
+        if(!strcmp(argv[i], "-r")) cfg.reps = atoi(argv[++i]);
+        else if(!strcmp(argv[i], "-w")) cfg.warmup = atoi(argv[++i]);
+        else if(!strcmp(argv[i], "-f")) cfg.filter = argv[++i];
+        else if(!strcmp(argv[i], "-o")) out = argv[++i];
+        else if(!strcmp(argv[i], "-b")) baseline = argv[++i];
+        else if(!strcmp(argv[i], "-t")) threshold = atof(argv[++i]);
+        else {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if(cfg.reps == 0) cfg.reps = 1;
+
+    bench_gemm(cfg);
+    bench_gemm_ooc(cfg);
+    bench_elementwise(cfg);
+    bench_matrix(cfg);
+    bench_conv2d(cfg);
+    bench_conv_pool(cfg);
+    bench_random(cfg);
+    bench_sparse(cfg);
+    bench_norm(cfg);
+    bench_activations(cfg);
+
+    FILE *fp = out ? fopen(out, "w") : stdout;
+    if(!fp){
+        fprintf(stderr, "Couldn't open %s\n", out);
+        return 1;
+    }
+    write_json(fp);
+    if(out) fclose(fp);
+
+    if(baseline && compare_baseline(baseline, threshold)) return 2;
+    return 0;
+}
@@ -1,12 +1,59 @@
 #include <assert.h>
+#include <math.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
 #include "tensor.h"
 #include "matrix.h"
+#include "conv.h"
+#include "prof.h"
+#include "tune.h"
+#include "fft.h"
+#include "unary.h"
+#include "pool.h"
+
+#define MIN(a,b) (((a)<(b))?(a):(b))
+#define MAX(a,b) (((a)>(b))?(a):(b))
+
+// Fills col with patches for output rows [oy0, oy1). data holds image rows
+// [y0, y0 + band_rows) of every channel, so the whole image is just the band
+// starting at row 0.
+void im2col_band_(const float *data, size_t im_c, size_t im_h, size_t im_w,
+        size_t y0, size_t band_rows, size_t size_y, size_t size_x,
+        size_t stride, size_t pad, size_t oy0, size_t oy1, float *col)
+{
+    size_t i, y, x;
+    size_t res_w = (im_w + 2*pad - size_x)/stride + 1;
+    size_t rows = im_c*size_y*size_x;
+    size_t cols = (oy1 - oy0)*res_w;
+
+    for(i = 0; i < rows; ++i){
+        size_t dx = i%size_x;
+        size_t dy = (i/size_x)%size_y;
+        size_t ic = i/(size_y*size_x);
+        for(y = oy0; y < oy1; ++y){
+            float *out = col + i*cols + (y - oy0)*res_w;
+            // Negative coordinates wrap around and fail the bounds check
+            size_t ih = y*stride + dy - pad;
+            if(ih >= im_h){
+                for(x = 0; x < res_w; ++x) out[x] = 0;
+                continue;
+            }
+            assert(ih >= y0 && ih < y0 + band_rows);
+            const float *in = data + ic*band_rows*im_w + (ih - y0)*im_w;
+            for(x = 0; x < res_w; ++x){
+                size_t iw = x*stride + dx - pad;
+                out[x] = (iw < im_w) ? in[iw] : 0;
+            }
+        }
+    }
+}
 
 tensor im2col(tensor im, size_t size_y, size_t size_x, size_t stride, size_t pad)
 {
     assert(im.n == 3);
-    size_t i, j, k;
+    PROF_BEGIN(start);
 
     size_t im_c = im.size[0];
     size_t im_h = im.size[1];
@@ -19,40 +66,43 @@ tensor im2col(tensor im, size_t size_y, size_t size_x, size_t stride, size_t pad
     size_t cols = res_w * res_h;
     tensor col = tensor_vmake(2, rows, cols);
 
-    // TODO: 5.1
-    // Fill in the column matrix with patches from the image
-
-    for (i = 0; i < rows; ++i) {
-        size_t dx = i%size_x - pad;
-        size_t dy = (i/size_x)%size_y - pad;
-        //printf("%ld %ld\n", dy, dx);
-        size_t ic = i / (size_y*size_x);
-        for(j = 0; j < im_h + 2*pad - size_y + 1; j += stride){
-            for(k = 0; k < im_w + 2*pad - size_x + 1; k += stride){
-                float val = 0;
-                size_t iw = k + dx;
-                size_t ih = j + dy;
-                if(ih >= 0 && ih < im_h && iw >= 0 && iw < im_w){
-                    val = im.data[ic*im_w*im_h + ih*im_w + iw];
-                }
-                col.data[i*cols + (j/stride)*res_w + k/stride] = val;
-            }
-        }
-    }
+    im2col_band_(im.data, im_c, im_h, im_w, 0, im_h, size_y, size_x,
+            stride, pad, 0, res_h, col.data);
+    PROF_END(PROF_IM2COL, start, 0);
     return col;
 }
 
-tensor conv2d(tensor im, tensor filters, size_t stride, size_t pad)
+// Reshapes the (filters x pixels) GEMM output into a (filters x h x w) image
+tensor conv2d_output_(tensor res, size_t res_c, size_t res_h, size_t res_w)
 {
-    assert(filters.n == 4);
-    assert(im.n == 3);
-    assert(filters.size[1] == im.size[0]); // Filters and image have same # channels
+    assert(res.size[0] == res_c);
+    assert(res.size[1] == res_h*res_w);
+    res.n = 3;
+    free(res.size);
+    res.size = calloc(3, sizeof(size_t));
+    res.size[0] = res_c;
+    res.size[1] = res_h;
+    res.size[2] = res_w;
+    return res;
+}
 
-    size_t f_c = filters.size[1];
+// a*b through matrix_multiply_into, which sums every output over k in
+// order. matrix_multiply sends a single column to the GEMV kernel, so a
+// one pixel output would round differently from the same pixel in a plan,
+// a stream band or a bigger image.
+static tensor conv2d_gemm_(tensor a, tensor b)
+{
+    size_t size[2] = {a.size[0], b.size[1]};
+    tensor t = tensor_make(2, size);
+    matrix_multiply_into(a, b, &t, tune_gemm(a.size[0], a.size[1], b.size[1]));
+    return t;
+}
+
+tensor conv2d_im2col_(tensor im, tensor filters, size_t stride, size_t pad)
+{
     size_t f_h = filters.size[2];
     size_t f_w = filters.size[3];
 
-    size_t im_c = im.size[0];
     size_t im_h = im.size[1];
     size_t im_w = im.size[2];
 
@@ -67,19 +117,240 @@ tensor conv2d(tensor im, tensor filters, size_t stride, size_t pad)
     filters.n = 2;
     filters.size = temp_size;
 
-    tensor res = matrix_multiply(filters, col);
+    tensor res = conv2d_gemm_(filters, col);
     tensor_free(col);
-    assert(res.size[0] == res_c);
-    assert(res.size[1] == res_h*res_w);
-    res.n = 3;
-    free(res.size);
-    res.size = calloc(3, sizeof(size_t));
-    res.size[0] = res_c;
-    res.size[1] = res_h;
-    res.size[2] = res_w;
+    return conv2d_output_(res, res_c, res_h, res_w);
+}
+
+// 1x1 filters with stride 1 and no padding: the image already is the column
+// matrix, so skip im2col entirely.
+tensor conv2d_1x1_(tensor im, tensor filters)
+{
+    size_t fsize[2] = {filters.size[0], filters.size[1]};
+    size_t isize[2] = {im.size[0], im.size[1]*im.size[2]};
+    size_t res_h = im.size[1];
+    size_t res_w = im.size[2];
+    filters.n = 2;
+    filters.size = fsize;
+    im.n = 2;
+    im.size = isize;
+    tensor res = conv2d_gemm_(filters, im);
+    return conv2d_output_(res, fsize[0], res_h, res_w);
+}
+
+// Direct convolution, one filter tap at a time over whole output rows.
+// Needs no workspace, which wins when im2col would blow out the cache.
+tensor conv2d_direct_(tensor im, tensor filters, size_t stride, size_t pad)
+{
+    size_t f_c = filters.size[1];
+    size_t f_h = filters.size[2];
+    size_t f_w = filters.size[3];
+
+    size_t im_h = im.size[1];
+    size_t im_w = im.size[2];
+
+    size_t res_c = filters.size[0];
+    size_t res_h = (im_h + 2*pad - f_h)/stride + 1;
+    size_t res_w = (im_w + 2*pad - f_w)/stride + 1;
+    tensor res = tensor_vmake(3, res_c, res_h, res_w);
+
+    size_t z, c, dy, dx, y, x;
+    for(z = 0; z < res_c; ++z){
+        for(c = 0; c < f_c; ++c){
+            for(dy = 0; dy < f_h; ++dy){
+                for(dx = 0; dx < f_w; ++dx){
+                    float w = filters.data[((z*f_c + c)*f_h + dy)*f_w + dx];
+                    // Output columns whose tap lands inside the image
+                    size_t x0 = (dx >= pad) ? 0 : (pad - dx + stride - 1)/stride;
+                    size_t x1 = (im_w + pad > dx) ? MIN(res_w, (im_w - 1 + pad - dx)/stride + 1) : 0;
+                    for(y = 0; y < res_h; ++y){
+                        size_t iy = y*stride + dy - pad;
+                        if(iy >= im_h) continue;
+                        float *out = res.data + (z*res_h + y)*res_w;
+                        const float *in = im.data + (c*im_h + iy)*im_w;
+                        for(x = x0; x < x1; ++x){
+                            out[x] += w*in[x*stride + dx - pad];
+                        }
+                    }
+                }
+            }
+        }
+    }
     return res;
 }
 
+// Winograd F(2x2, 3x3): every 2x2 output tile comes from a 4x4 input tile
+// with 16 multiplies instead of 36. The multiplies become 16 GEMMs of
+// (filters x channels) by (channels x tiles).
+tensor conv2d_winograd_(tensor im, tensor filters, size_t pad)
+{
+    size_t Z = filters.size[0];
+    size_t C = filters.size[1];
+    size_t im_h = im.size[1];
+    size_t im_w = im.size[2];
+    size_t res_h = im_h + 2*pad - 2;
+    size_t res_w = im_w + 2*pad - 2;
+    size_t th = (res_h + 1)/2;
+    size_t tw = (res_w + 1)/2;
+    size_t T = th*tw;
+    size_t i, j, p, z, c, ty, tx;
+
+    // U = G g G^T
+    tensor U = tensor_vmake(3, 16, Z, C);
+    for(z = 0; z < Z; ++z){
+        for(c = 0; c < C; ++c){
+            const float *g = filters.data + (z*C + c)*9;
+            float t[4][3];
+            for(j = 0; j < 3; ++j){
+                t[0][j] = g[j];
+                t[1][j] = .5f*(g[j] + g[3+j] + g[6+j]);
+                t[2][j] = .5f*(g[j] - g[3+j] + g[6+j]);
+                t[3][j] = g[6+j];
+            }
+            for(i = 0; i < 4; ++i){
+                float u[4] = {t[i][0], .5f*(t[i][0] + t[i][1] + t[i][2]),
+                    .5f*(t[i][0] - t[i][1] + t[i][2]), t[i][2]};
+                for(j = 0; j < 4; ++j){
+                    U.data[((i*4 + j)*Z + z)*C + c] = u[j];
+                }
+            }
+        }
+    }
+
+    // V = B^T d B
+    tensor V = tensor_vmake(3, 16, C, T);
+    for(c = 0; c < C; ++c){
+        for(ty = 0; ty < th; ++ty){
+            for(tx = 0; tx < tw; ++tx){
+                float d[4][4], t[4][4];
+                for(i = 0; i < 4; ++i){
+                    size_t iy = 2*ty + i - pad;
+                    for(j = 0; j < 4; ++j){
+                        size_t ix = 2*tx + j - pad;
+                        d[i][j] = (iy < im_h && ix < im_w) ? im.data[(c*im_h + iy)*im_w + ix] : 0;
+                    }
+                }
+                for(j = 0; j < 4; ++j){
+                    t[0][j] = d[0][j] - d[2][j];
+                    t[1][j] = d[1][j] + d[2][j];
+                    t[2][j] = d[2][j] - d[1][j];
+                    t[3][j] = d[1][j] - d[3][j];
+                }
+                for(i = 0; i < 4; ++i){
+                    float v[4] = {t[i][0] - t[i][2], t[i][1] + t[i][2],
+                        t[i][2] - t[i][1], t[i][1] - t[i][3]};
+                    for(j = 0; j < 4; ++j){
+                        V.data[((i*4 + j)*C + c)*T + ty*tw + tx] = v[j];
+                    }
+                }
+            }
+        }
+    }
+
+    tensor M = tensor_vmake(3, 16, Z, T);
+    for(p = 0; p < 16; ++p){
+        size_t usize[2] = {Z, C};
+        size_t vsize[2] = {C, T};
+        tensor u = {2, usize, U.data + p*Z*C};
+        tensor v = {2, vsize, V.data + p*C*T};
+        tensor m = conv2d_gemm_(u, v);
+        memcpy(M.data + p*Z*T, m.data, Z*T*sizeof(float));
+        tensor_free(m);
+    }
+    tensor_free(U);
+    tensor_free(V);
+
+    // Y = A^T m A
+    tensor res = tensor_vmake(3, Z, res_h, res_w);
+    for(z = 0; z < Z; ++z){
+        for(ty = 0; ty < th; ++ty){
+            for(tx = 0; tx < tw; ++tx){
+                float m[4][4], t[2][4];
+                for(p = 0; p < 16; ++p){
+                    m[p/4][p%4] = M.data[(p*Z + z)*T + ty*tw + tx];
+                }
+                for(j = 0; j < 4; ++j){
+                    t[0][j] = m[0][j] + m[1][j] + m[2][j];
+                    t[1][j] = m[1][j] - m[2][j] - m[3][j];
+                }
+                for(i = 0; i < 2; ++i){
+                    size_t oy = 2*ty + i;
+                    if(oy >= res_h) continue;
+                    float y0 = t[i][0] + t[i][1] + t[i][2];
+                    float y1 = t[i][1] - t[i][2] - t[i][3];
+                    res.data[(z*res_h + oy)*res_w + 2*tx] = y0;
+                    if(2*tx + 1 < res_w) res.data[(z*res_h + oy)*res_w + 2*tx + 1] = y1;
+                }
+            }
+        }
+    }
+    tensor_free(M);
+    return res;
+}
+
+// Runs through a plan, see conv2d_plan_fft_
+tensor conv2d_fft_(tensor im, tensor filters, size_t pad);
+
+int conv2d_algo_supported(conv_algo algo, const size_t *f_size, size_t stride, size_t pad)
+{
+    switch(algo){
+        case CONV_IM2COL:
+        case CONV_DIRECT:
+            return 1;
+        case CONV_1X1:
+            return f_size[2] == 1 && f_size[3] == 1 && stride == 1 && pad == 0;
+        case CONV_WINOGRAD:
+            return f_size[2] == 3 && f_size[3] == 3 && stride == 1;
+        case CONV_FFT:
+            return stride == 1 && f_size[2] < FFT_MAX && f_size[3] < FFT_MAX;
+        default:
+            return 0;
+    }
+}
+
+tensor conv2d_algo(tensor im, tensor filters, size_t stride, size_t pad, conv_algo algo)
+{
+    assert(filters.n == 4);
+    assert(im.n == 3);
+    assert(filters.size[1] == im.size[0]); // Filters and image have same # channels
+
+    size_t f_c = filters.size[1];
+    size_t f_h = filters.size[2];
+    size_t f_w = filters.size[3];
+    size_t res_c = filters.size[0];
+    size_t res_h = (im.size[1] + 2*pad - f_h)/stride + 1;
+    size_t res_w = (im.size[2] + 2*pad - f_w)/stride + 1;
+    if(!conv2d_algo_supported(algo, filters.size, stride, pad)) algo = CONV_IM2COL;
+
+    PROF_BEGIN(start);
+    tensor res;
+    switch(algo){
+        case CONV_1X1:
+            res = conv2d_1x1_(im, filters);
+            break;
+        case CONV_DIRECT:
+            res = conv2d_direct_(im, filters, stride, pad);
+            break;
+        case CONV_WINOGRAD:
+            res = conv2d_winograd_(im, filters, pad);
+            break;
+        case CONV_FFT:
+            res = conv2d_fft_(im, filters, pad);
+            break;
+        default:
+            res = conv2d_im2col_(im, filters, stride, pad);
+    }
+    PROF_END(PROF_CONV2D, start, 2.0*res_c*f_c*f_h*f_w*res_h*res_w);
+    return res;
+}
+
+tensor conv2d(tensor im, tensor filters, size_t stride, size_t pad)
+{
+    assert(filters.n == 4);
+    assert(im.n == 3);
+    return conv2d_algo(im, filters, stride, pad, tune_conv2d(im.size, filters.size, stride, pad));
+}
+
 tensor conv2d_slow(tensor im, tensor filters, size_t stride, size_t pad)
 {
     assert(filters.n == 4);
@@ -126,3 +397,860 @@ tensor conv2d_slow(tensor im, tensor filters, size_t stride, size_t pad)
     }
     return res;
 }
+
+// Cost of FFT work relative to GEMM flops, measured on 3 to 64 channel
+// images with 3x3 to 15x15 kernels. The transforms are cheaper per flop
+// than the interleaved complex products, which don't vectorize as well.
+#define CONV_FFT_TRANSFORM_WEIGHT 1.5
+#define CONV_FFT_PRODUCT_WEIGHT 6.0
+
+// Modelled cost of the FFT path with ph x pw tiles
+static double conv2d_fft_cost_(size_t ph, size_t pw, const size_t *f_size, size_t res_h, size_t res_w)
+{
+    double n = ph*pw;
+    double transform = 2.5*n*log2(n);
+    double bins = ph*(pw/2 + 1);
+    size_t oh = ph - f_size[2] + 1;
+    size_t ow = pw - f_size[3] + 1;
+    double tiles = (double)((res_h + oh - 1)/oh)*((res_w + ow - 1)/ow);
+    return tiles*(CONV_FFT_TRANSFORM_WEIGHT*(f_size[0] + f_size[1])*transform +
+            CONV_FFT_PRODUCT_WEIGHT*8*f_size[0]*f_size[1]*bins);
+}
+
+// Cheapest power of two tile that covers the filter, no bigger than needed
+// to cover the whole output at once
+static double conv2d_fft_tile_(const size_t *im_size, const size_t *f_size, size_t pad, size_t *ph, size_t *pw)
+{
+    size_t res_h = im_size[1] + 2*pad - f_size[2] + 1;
+    size_t res_w = im_size[2] + 2*pad - f_size[3] + 1;
+    double best = -1;
+    size_t h, w;
+    for(h = 1; h <= FFT_MAX; h <<= 1){
+        if(h < f_size[2] || h/2 >= res_h + f_size[2] - 1) continue;
+        for(w = 2; w <= FFT_MAX; w <<= 1){
+            if(w < f_size[3] || w/2 >= res_w + f_size[3] - 1) continue;
+            double cost = conv2d_fft_cost_(h, w, f_size, res_h, res_w);
+            if(best < 0 || cost < best){
+                best = cost;
+                *ph = h;
+                *pw = w;
+            }
+        }
+    }
+    return best;
+}
+
+double conv2d_algo_cost(conv_algo algo, const size_t *im_size, const size_t *f_size, size_t stride, size_t pad)
+{
+    size_t ph, pw;
+    double res_h = (im_size[1] + 2*pad - f_size[2])/stride + 1;
+    double res_w = (im_size[2] + 2*pad - f_size[3])/stride + 1;
+    double gemm = 2.0*f_size[0]*f_size[1]*f_size[2]*f_size[3]*res_h*res_w;
+    switch(algo){
+        case CONV_WINOGRAD:
+            return gemm*16/36;
+        case CONV_FFT:
+            return conv2d_fft_tile_(im_size, f_size, pad, &ph, &pw);
+        default:
+            return gemm;
+    }
+}
+
+// Column rows per filter gradient GEMM, the unit of work for threads
+#define CONV_FILTER_BAND 16
+
+struct conv2d_plan {
+    size_t im_size[3];
+    size_t f_size[4];
+    size_t stride;
+    size_t pad;
+    size_t res_h;
+    size_t res_w;
+    size_t rows;            // f_c*f_h*f_w, the GEMM inner dimension
+    int direct;             // 1x1 stride 1: the image is the column matrix
+    int fft;                // Tiled FFT instead of im2col
+    int padded;             // Padding in col is zero
+    gemm_config cfg;
+    // Tuned by the first backward call that needs them, flagged by tuned_t
+    // and tuned_f, so forward-only plans never search these shapes
+    gemm_config cfg_t;      // For the rows x filters by filters x pixels GEMM
+    gemm_config cfg_f;      // For the rows x pixels by pixels x filters GEMM
+    int tuned_t, tuned_f;
+
+    // Output rows [y_lo[dy], y_hi[dy]) and columns [x_lo[dx], x_hi[dx])
+    // whose tap lands inside the image. Everything outside is padding.
+    size_t *y_lo, *y_hi, *x_lo, *x_hi;
+
+    size_t fsize[2];
+    tensor filters;         // Shared handle, viewed as res_c x rows
+    tensor filters_t;       // rows x res_c, made by the input gradient
+    size_t csize[2];
+    tensor col;             // rows x res_h*res_w, padding zeroed at create
+    size_t osize[2];
+    size_t gtsize[2];
+    tensor grad_t;          // res_h*res_w x res_c, made by the filter gradient
+    size_t dtsize[2];
+    tensor dfilters_t;      // rows x res_c, likewise
+
+    // FFT path: ph x pw transforms, each giving (ph - f_h + 1) x
+    // (pw - f_w + 1) outputs, with spectra of ph*(pw/2 + 1) complex bins
+    size_t ph, pw, bins;
+    tensor spectra;         // res_c x f_c conjugated filter spectra, scaled by 1/(ph*pw)
+    float *in_spec;         // f_c input tile spectra
+    float *out_spec;        // res_c output tile spectra
+    float *tiles;           // max(f_c, res_c) real ph x pw tiles
+    float *work;            // 2*ph floats per tile for the column transforms
+};
+
+// Ensures the column workspace exists. FFT plans only need it for the
+// backward pass.
+static void conv2d_plan_col_(conv2d_plan *p)
+{
+    if(p->direct || p->col.data) return;
+    p->col = tensor_make(2, p->csize);
+    p->padded = 1;
+}
+
+// tile is the FFT tile shape, 0 for the cheapest one for this geometry
+static conv2d_plan *conv2d_plan_create_(const size_t *im_size, const size_t *f_size,
+        size_t stride, size_t pad, conv_algo algo, const size_t *tile)
+{
+    assert(f_size[1] == im_size[0]); // Filters and image have same # channels
+    conv2d_plan *p = calloc(1, sizeof(conv2d_plan));
+    size_t f_h = f_size[2];
+    size_t f_w = f_size[3];
+    size_t im_h = im_size[1];
+    size_t im_w = im_size[2];
+    size_t d;
+    memcpy(p->im_size, im_size, sizeof(p->im_size));
+    memcpy(p->f_size, f_size, sizeof(p->f_size));
+    p->stride = stride;
+    p->pad = pad;
+    p->res_h = (im_h + 2*pad - f_h)/stride + 1;
+    p->res_w = (im_w + 2*pad - f_w)/stride + 1;
+    p->rows = f_size[1]*f_h*f_w;
+    p->direct = conv2d_algo_supported(CONV_1X1, f_size, stride, pad);
+    p->fft = !p->direct && algo == CONV_FFT && conv2d_algo_supported(CONV_FFT, f_size, stride, pad);
+    // The FFT path runs no forward GEMM, so only im2col plans tune one
+    if(!p->fft) p->cfg = tune_gemm(f_size[0], p->rows, p->res_h*p->res_w);
+
+    // Same bounds as conv2d_direct_, per tap row and tap column
+    p->y_lo = calloc(f_h, sizeof(size_t));
+    p->y_hi = calloc(f_h, sizeof(size_t));
+    p->x_lo = calloc(f_w, sizeof(size_t));
+    p->x_hi = calloc(f_w, sizeof(size_t));
+    for(d = 0; d < f_h; ++d){
+        p->y_lo[d] = (d >= pad) ? 0 : MIN(p->res_h, (pad - d + stride - 1)/stride);
+        p->y_hi[d] = (im_h + pad > d) ? MIN(p->res_h, (im_h - 1 + pad - d)/stride + 1) : 0;
+        if(p->y_hi[d] < p->y_lo[d]) p->y_hi[d] = p->y_lo[d];
+    }
+    for(d = 0; d < f_w; ++d){
+        p->x_lo[d] = (d >= pad) ? 0 : MIN(p->res_w, (pad - d + stride - 1)/stride);
+        p->x_hi[d] = (im_w + pad > d) ? MIN(p->res_w, (im_w - 1 + pad - d)/stride + 1) : 0;
+        if(p->x_hi[d] < p->x_lo[d]) p->x_hi[d] = p->x_lo[d];
+    }
+
+    p->fsize[0] = f_size[0];
+    p->fsize[1] = p->rows;
+    p->csize[0] = p->rows;
+    p->csize[1] = p->res_h*p->res_w;
+    p->osize[0] = f_size[0];
+    p->osize[1] = p->res_h*p->res_w;
+    p->gtsize[0] = p->osize[1];
+    p->gtsize[1] = p->osize[0];
+    p->dtsize[0] = p->rows;
+    p->dtsize[1] = p->osize[0];
+
+    if(p->fft){
+        size_t n = MAX(f_size[0], f_size[1]);
+        if(tile){
+            p->ph = tile[0];
+            p->pw = tile[1];
+        } else {
+            conv2d_fft_tile_(im_size, f_size, pad, &p->ph, &p->pw);
+        }
+        p->bins = p->ph*(p->pw/2 + 1);
+        p->in_spec = calloc(2*f_size[1]*p->bins, sizeof(float));
+        p->out_spec = calloc(2*f_size[0]*p->bins, sizeof(float));
+        p->tiles = calloc(n*p->ph*p->pw, sizeof(float));
+        p->work = calloc(2*n*p->ph, sizeof(float));
+    } else {
+        conv2d_plan_col_(p);
+    }
+    return p;
+}
+
+conv2d_plan *conv2d_plan_create(const size_t *im_size, const size_t *f_size, size_t stride, size_t pad)
+{
+    conv_algo algo = tune_conv2d(im_size, f_size, stride, pad);
+    return conv2d_plan_create_(im_size, f_size, stride, pad, algo == CONV_FFT ? CONV_FFT : CONV_IM2COL, 0);
+}
+
+// Filter spectra for p's tile shape, made in p's FFT scratch
+static tensor conv2d_plan_spectra_(conv2d_plan *p, tensor filters)
+{
+    size_t f_c = p->f_size[1];
+    size_t f_h = p->f_size[2];
+    size_t f_w = p->f_size[3];
+    size_t ssize[1] = {2*p->f_size[0]*f_c*p->bins};
+    tensor spectra = tensor_make(1, ssize);
+    float scale = 1.f/(p->ph*p->pw);
+    size_t z, c;
+    // Correlation is convolution with the mirrored filter, so keep the
+    // conjugate spectrum, with the inverse transform's scale folded in
+    for(z = 0; z < p->fsize[0]; ++z){
+        #pragma omp parallel for schedule(static)
+        for(c = 0; c < f_c; ++c){
+            float *tile = p->tiles + c*p->ph*p->pw;
+            float *spec = spectra.data + 2*(z*f_c + c)*p->bins;
+            size_t y, b;
+            memset(tile, 0, p->ph*p->pw*sizeof(float));
+            for(y = 0; y < f_h; ++y){
+                memcpy(tile + y*p->pw, filters.data + ((z*f_c + c)*f_h + y)*f_w, f_w*sizeof(float));
+            }
+            fft2d_r2c(tile, p->ph, p->pw, spec, p->work + 2*c*p->ph);
+            for(b = 0; b < p->bins; ++b){
+                spec[2*b] *= scale;
+                spec[2*b+1] *= -scale;
+            }
+        }
+    }
+    return spectra;
+}
+
+void conv2d_plan_set_filters(conv2d_plan *p, tensor filters)
+{
+    assert(filters.n == 4);
+    assert(memcmp(filters.size, p->f_size, sizeof(p->f_size)) == 0);
+    tensor_free(p->filters);
+    tensor_free(p->filters_t);
+    // The row-major filters already are the A panels the GEMM streams, so a
+    // shared handle is enough and later writes to filters detach from it.
+    // The transpose waits for the input gradient.
+    p->filters = tensor_retain(filters);
+    p->filters_t = (tensor){0};
+
+    if(!p->fft) return;
+    tensor_free(p->spectra);
+    p->spectra = conv2d_plan_spectra_(p, filters);
+}
+
+tensor conv2d_plan_output(const conv2d_plan *p)
+{
+    return tensor_vmake(3, p->f_size[0], p->res_h, p->res_w);
+}
+
+// Gathers only the in-image part of each column row. The zero padding is
+// written at create and again only after backward_input used col as scratch.
+static void conv2d_plan_im2col_(conv2d_plan *p, const float *im)
+{
+    size_t im_h = p->im_size[1];
+    size_t im_w = p->im_size[2];
+    size_t f_h = p->f_size[2];
+    size_t f_w = p->f_size[3];
+    size_t stride = p->stride;
+    size_t res_w = p->res_w;
+    size_t cols = p->res_h*res_w;
+    size_t i, y, x;
+    conv2d_plan_col_(p);
+    if(!p->padded){
+        memset(p->col.data, 0, p->rows*cols*sizeof(float));
+        p->padded = 1;
+    }
+    for(i = 0; i < p->rows; ++i){
+        size_t dx = i%f_w;
+        size_t dy = (i/f_w)%f_h;
+        size_t ic = i/(f_h*f_w);
+        size_t x0 = p->x_lo[dx], x1 = p->x_hi[dx];
+        float *col = p->col.data + i*cols;
+        for(y = p->y_lo[dy]; y < p->y_hi[dy]; ++y){
+            float *out = col + y*res_w;
+            const float *in = im + (ic*im_h + y*stride + dy - p->pad)*im_w;
+            if(stride == 1){
+                memcpy(out + x0, in + x0 + dx - p->pad, (x1 - x0)*sizeof(float));
+            } else {
+                for(x = x0; x < x1; ++x) out[x] = in[x*stride + dx - p->pad];
+            }
+        }
+    }
+}
+
+// Overlap-save: every output block reads a ph x pw input tile that holds
+// all of its taps, so the circular correlation is exact over the block and
+// blocks never overlap in the output
+static void conv2d_plan_fft_(conv2d_plan *p, const float *im, float *out)
+{
+    size_t f_c = p->f_size[1];
+    size_t res_c = p->f_size[0];
+    size_t im_h = p->im_size[1];
+    size_t im_w = p->im_size[2];
+    size_t ph = p->ph, pw = p->pw, bins = p->bins;
+    size_t oh = ph - p->f_size[2] + 1;
+    size_t ow = pw - p->f_size[3] + 1;
+    size_t pad = p->pad;
+    size_t oy0, ox0, c, z;
+    for(oy0 = 0; oy0 < p->res_h; oy0 += oh){
+        for(ox0 = 0; ox0 < p->res_w; ox0 += ow){
+            size_t rows = MIN(oh, p->res_h - oy0);
+            size_t cols = MIN(ow, p->res_w - ox0);
+            // Tile columns [x0, x1) fall inside the image
+            size_t x0 = (pad > ox0) ? MIN(pw, pad - ox0) : 0;
+            size_t x1 = (im_w + pad > ox0) ? MIN(pw, im_w + pad - ox0) : 0;
+            if(x1 < x0) x1 = x0;
+
+            #pragma omp parallel for schedule(static)
+            for(c = 0; c < f_c; ++c){
+                float *tile = p->tiles + c*ph*pw;
+                size_t y;
+                for(y = 0; y < ph; ++y){
+                    float *row = tile + y*pw;
+                    size_t iy = oy0 + y - pad;
+                    if(iy >= im_h){
+                        memset(row, 0, pw*sizeof(float));
+                        continue;
+                    }
+                    memset(row, 0, x0*sizeof(float));
+                    memcpy(row + x0, im + (c*im_h + iy)*im_w + ox0 + x0 - pad, (x1 - x0)*sizeof(float));
+                    memset(row + x1, 0, (pw - x1)*sizeof(float));
+                }
+                fft2d_r2c(tile, ph, pw, p->in_spec + 2*c*bins, p->work + 2*c*ph);
+            }
+
+            #pragma omp parallel for schedule(static)
+            for(z = 0; z < res_c; ++z){
+                float *acc = p->out_spec + 2*z*bins;
+                float *tile = p->tiles + z*ph*pw;
+                size_t k, b, y;
+                memset(acc, 0, 2*bins*sizeof(float));
+                for(k = 0; k < f_c; ++k){
+                    const float *s = p->in_spec + 2*k*bins;
+                    const float *f = p->spectra.data + 2*(z*f_c + k)*bins;
+                    for(b = 0; b < bins; ++b){
+                        acc[2*b] += s[2*b]*f[2*b] - s[2*b+1]*f[2*b+1];
+                        acc[2*b+1] += s[2*b]*f[2*b+1] + s[2*b+1]*f[2*b];
+                    }
+                }
+                fft2d_c2r(acc, ph, pw, tile, p->work + 2*z*ph);
+                for(y = 0; y < rows; ++y){
+                    memcpy(out + (z*p->res_h + oy0 + y)*p->res_w + ox0, tile + y*pw, cols*sizeof(float));
+                }
+            }
+        }
+    }
+}
+
+static void conv2d_plan_run_(conv2d_plan *p, tensor im, float *data)
+{
+    if(p->fft){
+        conv2d_plan_fft_(p, im.data, data);
+        return;
+    }
+    memset(data, 0, p->osize[0]*p->osize[1]*sizeof(float));
+    tensor a = {2, p->fsize, p->filters.data};
+    tensor b = {2, p->csize, im.data};
+    tensor c = {2, p->osize, data};
+    if(!p->direct){
+        conv2d_plan_im2col_(p, im.data);
+        b.data = p->col.data;
+    }
+    matrix_multiply_into(a, b, &c, p->cfg);
+}
+
+void conv2d_plan_execute(conv2d_plan *p, tensor im, tensor *out)
+{
+    assert(im.n == 3);
+    assert(memcmp(im.size, p->im_size, sizeof(p->im_size)) == 0);
+    assert(p->filters.data);
+    assert(tensor_len(*out) == p->osize[0]*p->osize[1]);
+    PROF_BEGIN(start);
+    conv2d_plan_run_(p, im, tensor_mutable(out));
+    PROF_END(PROF_CONV2D, start, 2.0*p->f_size[0]*p->rows*p->res_h*p->res_w);
+}
+
+// Filter spectra of recent stateless FFT calls. An entry keeps a shared
+// handle on its filters, so a caller writing to them through
+// tensor_mutable detaches into a new buffer and no longer matches; views
+// without a buffer have no identity and are never cached. Entries are
+// replaced round robin.
+#define CONV_FFT_CACHE 8
+
+typedef struct conv2d_fft_entry {
+    tensor filters;
+    size_t ph, pw;
+    tensor spectra;
+} conv2d_fft_entry;
+
+static conv2d_fft_entry conv2d_fft_cache[CONV_FFT_CACHE];
+static size_t conv2d_fft_next = 0;
+static pthread_mutex_t conv2d_fft_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Spectra of filters for p's tiles, from the cache or computed and added.
+// Returns a handle the caller frees.
+static tensor conv2d_fft_spectra_(conv2d_plan *p, tensor filters)
+{
+    tensor spectra = {0};
+    size_t i;
+    if(!filters.buf) return conv2d_plan_spectra_(p, filters);
+    pthread_mutex_lock(&conv2d_fft_lock);
+    for(i = 0; i < CONV_FFT_CACHE; ++i){
+        conv2d_fft_entry *e = conv2d_fft_cache + i;
+        if(e->filters.buf == filters.buf && e->filters.data == filters.data &&
+                memcmp(e->filters.size, filters.size, sizeof(p->f_size)) == 0 &&
+                e->ph == p->ph && e->pw == p->pw){
+            spectra = tensor_retain(e->spectra);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&conv2d_fft_lock);
+    if(spectra.data) return spectra;
+
+    // Transform outside the lock; two threads missing on the same filters
+    // both add an entry, and the older one ages out
+    spectra = conv2d_plan_spectra_(p, filters);
+    pthread_mutex_lock(&conv2d_fft_lock);
+    conv2d_fft_entry *e = conv2d_fft_cache + conv2d_fft_next;
+    conv2d_fft_next = (conv2d_fft_next + 1)%CONV_FFT_CACHE;
+    tensor_free(e->filters);
+    tensor_free(e->spectra);
+    e->filters = tensor_retain(filters);
+    e->ph = p->ph;
+    e->pw = p->pw;
+    e->spectra = tensor_retain(spectra);
+    pthread_mutex_unlock(&conv2d_fft_lock);
+    return spectra;
+}
+
+// Through a one off FFT plan, which skips the GEMM tuning and workspaces,
+// with the filter spectra from the cache
+tensor conv2d_fft_(tensor im, tensor filters, size_t pad)
+{
+    conv2d_plan *p = conv2d_plan_create_(im.size, filters.size, 1, pad, CONV_FFT, 0);
+    // 1x1 filters make a direct plan instead
+    if(p->fft) p->spectra = conv2d_fft_spectra_(p, filters);
+    else conv2d_plan_set_filters(p, filters);
+    tensor res = conv2d_plan_output(p);
+    conv2d_plan_run_(p, im, res.data);
+    conv2d_plan_free(p);
+    return res;
+}
+
+// Inverse of conv2d_plan_im2col_: every image element sums the column
+// entries it was copied to. Threads own whole image rows and read col, so
+// there are no write conflicts.
+static void conv2d_plan_col2im_(const conv2d_plan *p, const float *col, float *im)
+{
+    size_t im_h = p->im_size[1];
+    size_t im_w = p->im_size[2];
+    size_t f_h = p->f_size[2];
+    size_t f_w = p->f_size[3];
+    size_t stride = p->stride;
+    size_t res_w = p->res_w;
+    size_t cols = p->res_h*res_w;
+    size_t r;
+    #pragma omp parallel for schedule(static)
+    for(r = 0; r < p->im_size[0]*im_h; ++r){
+        size_t ic = r/im_h;
+        size_t iy = r%im_h;
+        size_t dy, dx, x;
+        float *out = im + r*im_w;
+        memset(out, 0, im_w*sizeof(float));
+        for(dy = 0; dy < f_h; ++dy){
+            // Output row whose tap dy reads image row iy, if any
+            size_t ty = iy + p->pad - dy;
+            if(ty >= p->res_h*stride || ty%stride) continue;
+            size_t y = ty/stride;
+            for(dx = 0; dx < f_w; ++dx){
+                const float *in = col + ((ic*f_h + dy)*f_w + dx)*cols + y*res_w;
+                for(x = p->x_lo[dx]; x < p->x_hi[dx]; ++x){
+                    out[x*stride + dx - p->pad] += in[x];
+                }
+            }
+        }
+    }
+}
+
+void conv2d_plan_backward_input(conv2d_plan *p, tensor grad, tensor *dim)
+{
+    assert(tensor_len(grad) == p->osize[0]*p->osize[1]);
+    assert(tensor_len(*dim) == p->im_size[0]*p->im_size[1]*p->im_size[2]);
+    assert(p->filters.data);
+    PROF_BEGIN(start);
+    if(!p->filters_t.data){
+        tensor f = {2, p->fsize, p->filters.data};
+        p->filters_t = matrix_transpose(f);
+    }
+    if(!p->tuned_t){
+        p->cfg_t = tune_gemm(p->rows, p->f_size[0], p->res_h*p->res_w);
+        p->tuned_t = 1;
+    }
+    float *data = tensor_mutable(dim);
+    tensor g = {2, p->osize, grad.data};
+    if(p->direct){
+        tensor d = {2, p->csize, data};
+        memset(data, 0, tensor_len(*dim)*sizeof(float));
+        matrix_multiply_into(p->filters_t, g, &d, p->cfg_t);
+    } else {
+        conv2d_plan_col_(p);
+        memset(p->col.data, 0, p->rows*p->csize[1]*sizeof(float));
+        p->padded = 0;
+        matrix_multiply_into(p->filters_t, g, &p->col, p->cfg_t);
+        conv2d_plan_col2im_(p, p->col.data, data);
+    }
+    PROF_END(PROF_CONV2D_BACKWARD_INPUT, start, 2.0*p->f_size[0]*p->rows*p->res_h*p->res_w);
+}
+
+// Packs the rows x cols matrix a into t as cols x rows, in square tiles so
+// both sides stay in cache
+static void conv2d_plan_transpose_(const float *a, size_t rows, size_t cols, float *t)
+{
+    size_t tile = 32;
+    size_t jb;
+    #pragma omp parallel for schedule(static)
+    for(jb = 0; jb < cols; jb += tile){
+        size_t ib, i, j;
+        size_t je = MIN(cols, jb + tile);
+        for(ib = 0; ib < rows; ib += tile){
+            size_t ie = MIN(rows, ib + tile);
+            for(j = jb; j < je; ++j){
+                for(i = ib; i < ie; ++i){
+                    t[j*rows + i] = a[i*cols + j];
+                }
+            }
+        }
+    }
+}
+
+// dfilters^T = col grad^T, through the same blocked GEMM as the forward
+// pass. Bands of col rows run on their own threads and produce whole rows
+// of dfilters^T, which is transposed back at the end. 1x1 plans take dot
+// products instead.
+void conv2d_plan_backward_filter(conv2d_plan *p, tensor im, tensor grad, tensor *dfilters)
+{
+    assert(im.n == 3);
+    assert(memcmp(im.size, p->im_size, sizeof(p->im_size)) == 0);
+    assert(tensor_len(grad) == p->osize[0]*p->osize[1]);
+    assert(tensor_len(*dfilters) == p->fsize[0]*p->fsize[1]);
+    PROF_BEGIN(start);
+    float *data = tensor_mutable(dfilters);
+    if(p->direct){
+        // 1x1 filters: a filter's row of dfilters is the (channels x
+        // pixels) image times its grad plane, one dot product per channel
+        // against a shared vector. The GEMV kernel runs those in vector
+        // lanes; the blocked GEMM's inner loop would run over the filters.
+        size_t gsize[1] = {p->csize[1]};
+        tensor c = {2, p->csize, im.data, 0};
+        size_t z;
+        for(z = 0; z < p->fsize[0]; ++z){
+            tensor g = {1, gsize, grad.data + z*p->csize[1], 0};
+            tensor y = matrix_gemv(c, g);
+            memcpy(data + z*p->rows, y.data, p->rows*sizeof(float));
+            tensor_free(y);
+        }
+        PROF_END(PROF_CONV2D_BACKWARD_FILTER, start, 2.0*p->f_size[0]*p->rows*p->res_h*p->res_w);
+        return;
+    }
+    conv2d_plan_im2col_(p, im.data);
+    if(!p->tuned_f){
+        p->cfg_f = tune_gemm(MIN(CONV_FILTER_BAND, p->rows), p->res_h*p->res_w, p->f_size[0]);
+        p->grad_t = tensor_make(2, p->gtsize);
+        p->dfilters_t = tensor_make(2, p->dtsize);
+        p->tuned_f = 1;
+    }
+    size_t Z = p->fsize[0];
+    size_t N = p->csize[1];
+    size_t nbands = (p->rows + CONV_FILTER_BAND - 1)/CONV_FILTER_BAND;
+    size_t b;
+    conv2d_plan_transpose_(grad.data, Z, N, p->grad_t.data);
+    memset(p->dfilters_t.data, 0, p->rows*Z*sizeof(float));
+    #pragma omp parallel for schedule(static)
+    for(b = 0; b < nbands; ++b){
+        size_t r0 = b*CONV_FILTER_BAND;
+        size_t csize[2] = {MIN(CONV_FILTER_BAND, p->rows - r0), N};
+        size_t dsize[2] = {csize[0], Z};
+        tensor c = {2, csize, p->col.data + r0*N, 0};
+        tensor d = {2, dsize, p->dfilters_t.data + r0*Z, 0};
+        matrix_multiply_into(c, p->grad_t, &d, p->cfg_f);
+    }
+    conv2d_plan_transpose_(p->dfilters_t.data, p->rows, Z, data);
+    PROF_END(PROF_CONV2D_BACKWARD_FILTER, start, 2.0*p->f_size[0]*p->rows*p->res_h*p->res_w);
+}
+
+tensor conv2d_backward_input(tensor grad, tensor filters, const size_t *im_size, size_t stride, size_t pad)
+{
+    assert(filters.n == 4);
+    conv2d_plan *p = conv2d_plan_create(im_size, filters.size, stride, pad);
+    conv2d_plan_set_filters(p, filters);
+    tensor dim = tensor_make(3, im_size);
+    conv2d_plan_backward_input(p, grad, &dim);
+    conv2d_plan_free(p);
+    return dim;
+}
+
+tensor conv2d_backward_filter(tensor grad, tensor im, const size_t *f_size, size_t stride, size_t pad)
+{
+    assert(im.n == 3);
+    conv2d_plan *p = conv2d_plan_create(im.size, f_size, stride, pad);
+    tensor df = tensor_make(4, f_size);
+    conv2d_plan_backward_filter(p, im, grad, &df);
+    conv2d_plan_free(p);
+    return df;
+}
+
+void conv2d_plan_free(conv2d_plan *p)
+{
+    if(!p) return;
+    free(p->y_lo);
+    free(p->y_hi);
+    free(p->x_lo);
+    free(p->x_hi);
+    tensor_free(p->filters);
+    tensor_free(p->filters_t);
+    tensor_free(p->col);
+    tensor_free(p->grad_t);
+    tensor_free(p->dfilters_t);
+    tensor_free(p->spectra);
+    free(p->in_spec);
+    free(p->out_spec);
+    free(p->tiles);
+    free(p->work);
+    free(p);
+}
+
+void conv2d_tensor_producer(void *ctx, size_t y, size_t rows, tensor band)
+{
+    tensor *im = ctx;
+    size_t c;
+    size_t im_h = im->size[1];
+    size_t im_w = im->size[2];
+    for(c = 0; c < im->size[0]; ++c){
+        memcpy(band.data + c*rows*im_w, im->data + (c*im_h + y)*im_w,
+                rows*im_w*sizeof(float));
+    }
+}
+
+// Input rows [lo, hi) that output rows [oy0, oy1) read, with the halo
+static void conv2d_stream_rows_(size_t im_h, size_t f_h, size_t stride, size_t pad,
+        size_t oy0, size_t oy1, size_t *lo, size_t *hi)
+{
+    size_t top = (oy1 - 1)*stride + f_h;
+    *lo = (oy0*stride > pad) ? oy0*stride - pad : 0;
+    *hi = (top > pad) ? MIN(top - pad, im_h) : 0;
+    if(*hi < *lo) *hi = *lo;
+}
+
+// im2col (and 1x1, the same GEMM) bands: im2col_band_ reads the halo
+// straight from the produced rows, and the column GEMM sums each output in
+// the same order as over the whole image
+static void conv2d_stream_im2col_(size_t im_c, size_t im_h, size_t im_w,
+        conv2d_producer produce, void *pctx,
+        tensor filters, size_t stride, size_t pad, size_t band_h,
+        conv2d_consumer consume, void *cctx)
+{
+    size_t f_h = filters.size[2];
+    size_t f_w = filters.size[3];
+
+    size_t res_c = filters.size[0];
+    size_t res_h = (im_h + 2*pad - f_h)/stride + 1;
+    size_t res_w = (im_w + 2*pad - f_w)/stride + 1;
+    size_t rows = im_c*f_h*f_w;
+
+    size_t temp_size[2] = {res_c, rows};
+    filters.n = 2;
+    filters.size = temp_size;
+
+    // Everything below is sized by the band, never by the full image
+    size_t max_in = MIN((band_h - 1)*stride + f_h, im_h);
+    size_t band_size[3] = {im_c, max_in, im_w};
+    tensor band = tensor_make(3, band_size);
+    tensor col = tensor_vmake(2, rows, band_h*res_w);
+
+    size_t oy0, lo, hi;
+    for(oy0 = 0; oy0 < res_h; oy0 += band_h){
+        size_t oy1 = MIN(oy0 + band_h, res_h);
+        conv2d_stream_rows_(im_h, f_h, stride, pad, oy0, oy1, &lo, &hi);
+
+        band.size[1] = hi - lo;
+        if(hi > lo) produce(pctx, lo, hi - lo, band);
+
+        col.size[1] = (oy1 - oy0)*res_w;
+        im2col_band_(band.data, im_c, im_h, im_w, lo, hi - lo, f_h, f_w,
+                stride, pad, oy0, oy1, col.data);
+
+        tensor res = conv2d_output_(conv2d_gemm_(filters, col), res_c, oy1 - oy0, res_w);
+        consume(cctx, oy0, res);
+        tensor_free(res);
+    }
+    tensor_free(band);
+    tensor_free(col);
+}
+
+// Direct, Winograd and FFT bands: the band's input rows go into a buffer
+// with the padding written out as zeros, and the algorithm runs on that
+// with no padding. Bands start on the algorithm's tile rows, so every
+// output is computed from the same values in the same order as over the
+// whole image. The FFT bands keep the whole image's tile shape.
+static void conv2d_stream_padded_(size_t im_c, size_t im_h, size_t im_w,
+        conv2d_producer produce, void *pctx,
+        tensor filters, size_t stride, size_t pad, size_t band_h, conv_algo algo,
+        conv2d_consumer consume, void *cctx)
+{
+    size_t f_h = filters.size[2];
+    size_t res_h = (im_h + 2*pad - f_h)/stride + 1;
+    size_t pw = im_w + 2*pad;
+    size_t im_size[3] = {im_c, im_h, im_w};
+    size_t tile[2] = {0, 0};
+    conv2d_plan *p = 0;
+
+    if(algo == CONV_FFT){
+        conv2d_fft_tile_(im_size, filters.size, pad, tile, tile + 1);
+        size_t oh = tile[0] - f_h + 1;
+        band_h = (band_h + oh - 1)/oh*oh;
+    } else if(algo == CONV_WINOGRAD){
+        band_h += band_h%2;
+    }
+
+    size_t max_in = MIN((band_h - 1)*stride + f_h, im_h);
+    size_t band_size[3] = {im_c, max_in, im_w};
+    tensor band = tensor_make(3, band_size);
+    size_t padded_size[3] = {im_c, (band_h - 1)*stride + f_h, pw};
+    tensor padded = tensor_make(3, padded_size);
+
+    size_t oy0, lo, hi, c, y;
+    for(oy0 = 0; oy0 < res_h; oy0 += band_h){
+        size_t oy1 = MIN(oy0 + band_h, res_h);
+        size_t prows = (oy1 - oy0 - 1)*stride + f_h;
+        conv2d_stream_rows_(im_h, f_h, stride, pad, oy0, oy1, &lo, &hi);
+
+        band.size[1] = hi - lo;
+        if(hi > lo) produce(pctx, lo, hi - lo, band);
+
+        // Padded row r is image row oy0*stride - pad + r
+        padded.size[1] = prows;
+        memset(padded.data, 0, im_c*prows*pw*sizeof(float));
+        for(c = 0; c < im_c; ++c){
+            for(y = lo; y < hi; ++y){
+                memcpy(padded.data + (c*prows + y + pad - oy0*stride)*pw + pad,
+                        band.data + (c*(hi - lo) + y - lo)*im_w, im_w*sizeof(float));
+            }
+        }
+
+        tensor res;
+        if(algo == CONV_FFT){
+            // A plan per band height, only the last band can differ
+            if(!p || p->im_size[1] != prows){
+                conv2d_plan_free(p);
+                p = conv2d_plan_create_(padded.size, filters.size, 1, 0, CONV_FFT, tile);
+                conv2d_plan_set_filters(p, filters);
+            }
+            res = conv2d_plan_output(p);
+            conv2d_plan_fft_(p, padded.data, res.data);
+        } else if(algo == CONV_WINOGRAD){
+            res = conv2d_winograd_(padded, filters, 0);
+        } else {
+            res = conv2d_direct_(padded, filters, stride, 0);
+        }
+        consume(cctx, oy0, res);
+        tensor_free(res);
+    }
+    conv2d_plan_free(p);
+    tensor_free(band);
+    tensor_free(padded);
+}
+
+void conv2d_stream(size_t im_c, size_t im_h, size_t im_w,
+        conv2d_producer produce, void *pctx,
+        tensor filters, size_t stride, size_t pad, size_t band_h,
+        conv2d_consumer consume, void *cctx)
+{
+    assert(filters.n == 4);
+    assert(filters.size[1] == im_c);
+    assert(band_h > 0);
+    PROF_BEGIN(start);
+
+    // The algorithm conv2d would run on the whole image
+    size_t im_size[3] = {im_c, im_h, im_w};
+    conv_algo algo = tune_conv2d(im_size, filters.size, stride, pad);
+    if(!conv2d_algo_supported(algo, filters.size, stride, pad)) algo = CONV_IM2COL;
+    if(algo == CONV_IM2COL || algo == CONV_1X1){
+        conv2d_stream_im2col_(im_c, im_h, im_w, produce, pctx, filters, stride, pad, band_h, consume, cctx);
+    } else {
+        conv2d_stream_padded_(im_c, im_h, im_w, produce, pctx, filters, stride, pad, band_h, algo, consume, cctx);
+    }
+
+    size_t res_h = (im_h + 2*pad - filters.size[2])/stride + 1;
+    size_t res_w = (im_w + 2*pad - filters.size[3])/stride + 1;
+    PROF_END(PROF_CONV2D_STREAM, start, 2.0*filters.size[0]*im_c*filters.size[2]*filters.size[3]*res_h*res_w);
+}
+
+// Conv output floats per band, about 128KB so a band is still in cache
+// when the activation and the pooling read it back
+#define CONV_POOL_BAND 32768
+
+tensor conv2d_act_pool(tensor im, tensor filters, size_t stride, size_t pad, unary_op act,
+        pool_type type, size_t size, size_t pool_stride, size_t pool_pad)
+{
+    assert(im.n == 3);
+    assert(filters.n == 4);
+    assert(filters.size[1] == im.size[0]);
+    PROF_BEGIN(start);
+
+    size_t im_c = im.size[0];
+    size_t im_h = im.size[1];
+    size_t im_w = im.size[2];
+    size_t f_h = filters.size[2];
+    size_t f_w = filters.size[3];
+
+    size_t res_c = filters.size[0];
+    size_t res_h = (im_h + 2*pad - f_h)/stride + 1;
+    size_t res_w = (im_w + 2*pad - f_w)/stride + 1;
+    size_t rows = im_c*f_h*f_w;
+    size_t out_h = pool2d_output_size(res_h, size, pool_stride, pool_pad);
+    size_t out_w = pool2d_output_size(res_w, size, pool_stride, pool_pad);
+
+    size_t temp_size[2] = {res_c, rows};
+    filters.n = 2;
+    filters.size = temp_size;
+
+    // Pooled rows per band, and the most conv rows one band needs. Windows
+    // that overlap across bands recompute their shared conv rows.
+    size_t band = MAX(1, CONV_POOL_BAND/(res_c*res_w*pool_stride));
+    size_t max_rows = MIN((band - 1)*pool_stride + size, res_h);
+    size_t nbands = (out_h + band - 1)/band;
+    gemm_config cfg = tune_gemm(res_c, rows, max_rows*res_w);
+    tensor out = tensor_vmake(3, res_c, out_h, out_w);
+    size_t b;
+
+    #pragma omp parallel
+    {
+        float *col = calloc(rows*max_rows*res_w, sizeof(float));
+        float *conv = calloc(res_c*max_rows*res_w, sizeof(float));
+        #pragma omp for schedule(dynamic)
+        for(b = 0; b < nbands; ++b){
+            size_t py0 = b*band;
+            size_t py1 = MIN(py0 + band, out_h);
+            // Conv rows [lo, hi) feed pooled rows [py0, py1)
+            size_t lo = py0*pool_stride > pool_pad ? py0*pool_stride - pool_pad : 0;
+            size_t hi = MIN((py1 - 1)*pool_stride + size - pool_pad, res_h);
+            size_t n = (hi - lo)*res_w;
+            size_t c;
+
+            size_t csize[2] = {rows, n};
+            size_t osize[2] = {res_c, n};
+            tensor tcol = {2, csize, col, 0};
+            tensor tconv = {2, osize, conv, 0};
+            im2col_band_(im.data, im_c, im_h, im_w, 0, im_h, f_h, f_w,
+                    stride, pad, lo, hi, col);
+            memset(conv, 0, res_c*n*sizeof(float));
+            matrix_multiply_into(filters, tcol, &tconv, cfg);
+            unary_apply(conv, conv, res_c*n, act);
+            for(c = 0; c < res_c; ++c){
+                pool2d_band(conv + c*n, res_h, res_w, lo, hi - lo, type, size,
+                        pool_stride, pool_pad, py0, py1, out.data + (c*out_h + py0)*out_w);
+            }
+        }
+        free(col);
+        free(conv);
+    }
+    PROF_END(PROF_CONV2D_ACT_POOL, start, 2.0*res_c*rows*res_h*res_w);
+    return out;
+}
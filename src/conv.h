@@ -2,13 +2,100 @@
 #ifndef CONV_H
 #define CONV_H
 #include <stdio.h>
+#include "tensor.h"
+#include "unary.h"
+#include "pool.h"
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 
+typedef enum {
+    CONV_IM2COL,
+    CONV_DIRECT,
+    CONV_1X1,
+    CONV_WINOGRAD,
+    CONV_FFT,
+    CONV_NALGOS
+} conv_algo;
+
+tensor im2col(tensor im, size_t size_y, size_t size_x, size_t stride, size_t pad);
+// Reshapes a (res_c x res_h*res_w) GEMM result into a (res_c x res_h x res_w)
+// image in place and returns it. Shared by the dense and sparse conv2d.
+tensor conv2d_output_(tensor res, size_t res_c, size_t res_h, size_t res_w);
 tensor conv2d(tensor im, tensor filters, size_t stride, size_t pad);
 tensor conv2d_slow(tensor im, tensor filters, size_t stride, size_t pad);
+// conv2d picks an algorithm from the tuning cache (see tune.h), these force one.
+// Unsupported choices (Winograd is 3x3 stride 1 only, 1x1 needs stride 1 and
+// no padding, FFT needs stride 1) fall back to im2col.
+// The FFT path keeps the spectra of the last few filters it saw, matched by
+// buffer and shape, so repeated calls with the same filters skip their
+// transforms; writing the filters through tensor_mutable detaches them from
+// the cached copy. It still sets up tile workspaces on every call, which a
+// conv2d_plan keeps.
+int conv2d_algo_supported(conv_algo algo, const size_t *f_size, size_t stride, size_t pad);
+tensor conv2d_algo(tensor im, tensor filters, size_t stride, size_t pad, conv_algo algo);
+// Modelled cost in GEMM flops, for choosing an algorithm without timing
+double conv2d_algo_cost(conv_algo algo, const size_t *im_size, const size_t *f_size, size_t stride, size_t pad);
+
+// Reusable convolution for a fixed image shape, filter shape, stride and pad.
+// Create computes the output geometry, the im2col gather ranges and the GEMM
+// blocking once and owns the workspace, so execute does no setup and no
+// allocation. Filters are bound with conv2d_plan_set_filters and kept as a
+// shared handle (see tensor_retain). Plans run im2col (1x1 when it applies)
+// or, when tune_conv2d picks it, the tiled FFT path with the filter spectra
+// computed by set_filters. Results match conv2d_algo with the same
+// algorithm bit for bit.
+// A plan owns a single column workspace that execute and the backward
+// passes all write, so one plan must not be used by two threads at once.
+// Give each thread its own plan.
+typedef struct conv2d_plan conv2d_plan;
+conv2d_plan *conv2d_plan_create(const size_t *im_size, const size_t *f_size, size_t stride, size_t pad);
+void conv2d_plan_set_filters(conv2d_plan *p, tensor filters);
+// Makes a zeroed tensor of the plan's output shape
+tensor conv2d_plan_output(const conv2d_plan *p);
+// Overwrites out, which must have the output shape
+void conv2d_plan_execute(conv2d_plan *p, tensor im, tensor *out);
+void conv2d_plan_free(conv2d_plan *p);
+
+// Gradients of conv2d given grad, the gradient of the (filters x h x w)
+// output. The input gradient is a col2im gather partitioned by image rows,
+// so threads never write the same element. The filter gradient runs the
+// blocked GEMM with its own tuned config on bands of column rows, or for
+// 1x1 filters one matrix_gemv per filter over the image. The plan
+// versions reuse the column workspace and overwrite their result. A plan
+// tunes the backward GEMM shapes and transposes its filters on the first
+// backward call that needs them, so forward-only plans skip that setup.
+void conv2d_plan_backward_input(conv2d_plan *p, tensor grad, tensor *dim);
+void conv2d_plan_backward_filter(conv2d_plan *p, tensor im, tensor grad, tensor *dfilters);
+tensor conv2d_backward_input(tensor grad, tensor filters, const size_t *im_size, size_t stride, size_t pad);
+tensor conv2d_backward_filter(tensor grad, tensor im, const size_t *f_size, size_t stride, size_t pad);
+
+// Streaming convolution over horizontal bands of the image.
+// The producer fills image rows [y, y+rows) of every channel into band,
+// a (channels x rows x width) tensor. The consumer gets output rows
+// [y, y+band.size[1]) as a (filters x rows x width) tensor it must not free.
+// Peak memory depends on band_h (output rows per band), not on the image.
+// Bands run the algorithm conv2d picks for the whole image, so the output
+// matches conv2d bit for bit. Winograd bands are rounded up to an even
+// number of rows and FFT bands to whole tiles of the whole image's tile
+// shape, so a band can hold more than band_h rows.
+typedef void (*conv2d_producer)(void *ctx, size_t y, size_t rows, tensor band);
+typedef void (*conv2d_consumer)(void *ctx, size_t y, tensor band);
+void conv2d_stream(size_t im_c, size_t im_h, size_t im_w,
+        conv2d_producer produce, void *pctx,
+        tensor filters, size_t stride, size_t pad, size_t band_h,
+        conv2d_consumer consume, void *cctx);
+// Producer reading from an in-memory or mmapped tensor, ctx is a tensor *
+void conv2d_tensor_producer(void *ctx, size_t y, size_t rows, tensor band);
+
+// conv2d, then act, then pool2d, as one pass. The convolution runs over
+// bands of output rows sized to stay in cache, and each band is activated
+// and pooled before the next one is computed, so the full resolution
+// output is never stored. Bands run on separate threads. The result
+// matches the three separate im2col ops bit for bit.
+tensor conv2d_act_pool(tensor im, tensor filters, size_t stride, size_t pad, unary_op act,
+        pool_type type, size_t size, size_t pool_stride, size_t pool_pad);
 
 
 #ifdef __cplusplus
@@ -0,0 +1,158 @@
+// Include guards and C++ compatibility
+#ifndef FASTMATH_H
+#define FASTMATH_H
+#include <stdint.h>
+#include <math.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Branch free float approximations that gcc vectorizes when they are called
+// from a simple loop. Error bounds are measured over the whole float range
+// the function accepts, against the double precision libm result, as
+// vectorized under -Ofast: there a float division becomes a reciprocal
+// estimate and a Newton step, which costs up to a couple of ulp.
+
+// exp(x) = 2^n exp(x - n ln2) with n = round(x/ln2). ln2 is split as
+// 355/512 - 2.1219444e-4 so r = x - n*355/512 is exact, and exp(r) and
+// exp(n*2.1219444e-4) come from separate Taylor series: -Ofast would
+// reassociate the usual r + n*lo back into x - n*ln2. Adding 1.5*2^23
+// rounds x/ln2 into the low mantissa bits, and 2^n goes into the exponent
+// bits with an integer add, a float multiply could be reordered into a
+// flushed denormal.
+// Within 2.5 ulp where the result is a normal float. Below -87.33 (denormal
+// results, and -inf) it returns 0, above 88.37 it saturates at 2.4e38.
+static inline float fast_expf(float x)
+{
+    union { uint32_t i; float f; } s, b;
+    float c = x < -87.33654f ? -87.33654f : x;
+    c = c > 88.37626f ? 88.37626f : c;
+    b.f = c*1.44269504f + 12582912.f;
+    int n = (int)(b.i - 0x4b400000);
+    float fn = (float)n;
+    float r = c - fn*.693359375f;
+    float d = fn*2.12194440e-4f;
+    float p = 1.f + r*(1.f + r*(.5f + r*(1.f/6 + r*(1.f/24 + r*(1.f/120 + r*(1.f/720 + r*(1.f/5040)))))));
+    float q = 1.f + d*(1.f + d*(.5f + d*(1.f/6)));
+    s.f = p*q;
+    s.i += (uint32_t)n << 23;
+    return x < -87.33654f ? 0.f : s.f;
+}
+
+// log(x) = e ln2 + log(m) with x = 2^e m, m in [sqrt(1/2), sqrt(2)), and
+// log(m) = 2 atanh(s) = 2s(1 + s^2/3 + s^4/5 + ...) with s = (m-1)/(m+1),
+// |s| < 0.172. e ln2 uses the same split as fast_expf.
+// Within 5 ulp for normal x. 0 and denormals give -inf, negative x NaN.
+static inline float fast_logf(float x)
+{
+    union { uint32_t i; float f; } u;
+    u.f = x;
+    int e = (int)((u.i >> 23) & 0xff) - 127;
+    u.i = (u.i & 0x7fffff) | 0x3f800000;
+    float m = u.f;
+    int big = m > 1.41421356f;
+    m = big ? .5f*m : m;
+    e += big;
+    float s = (m - 1.f)/(m + 1.f);
+    float z = s*s;
+    float p = 2.f*s*(1.f + z*(1.f/3 + z*(1.f/5 + z*(1.f/7 + z*(1.f/9)))));
+    float fe = (float)e;
+    float l = fe*.693359375f + (fe*-2.12194440e-4f + p);
+    l = x > 0 ? l : -1.f/0.f;
+    return x < 0 ? 0.f/0.f : l;
+}
+
+// Odd polynomial near 0 (coefficients from Cephes tanhf), where
+// 1 - 2/(exp(2x) + 1) would cancel, that form above 0.625.
+// Within 2.5 ulp.
+static inline float fast_tanhf(float x)
+{
+    float a = x < 0 ? -x : x;
+    float z = x*x;
+    float small = x + x*z*(-3.33332819422e-1f + z*(1.33314422036e-1f + z*(-5.37397155531e-2f
+        + z*(2.06390887954e-2f + z*-5.70498872745e-3f))));
+    float big = 1.f - 2.f/(fast_expf(2.f*a) + 1.f);
+    big = x < 0 ? -big : big;
+    return a < .625f ? small : big;
+}
+
+// Loop kernels. Under -ffast-math on x86-64, glibc declares SIMD versions
+// of expf, logf and tanhf (libmvec, tanhf since 2.35) and gcc vectorizes
+// plain calls to them. That is the default -Ofast build on x86-64 Linux,
+// so there the polynomials above are only a fallback: for everywhere else
+// (other architectures, other libcs, builds without -ffast-math), and for
+// -DFASTMATH_LIBMVEC=0. libmvec is preferred where it exists because it
+// measured faster on every op. Median time of the unary/ benches
+// (tenswords_bench -f unary/, 4M floats, gcc 12, glibc 2.36, SSE2, one
+// thread), libmvec against the polynomials:
+//   exp 11.8 vs 12.9 ms, log 12.1 vs 15.2 ms, tanh 14.8 vs 28.0 ms,
+//   sigmoid 13.8 vs 17.1 ms, gelu 16.2 vs 20.9 ms.
+// The tests check the polynomials' bounds in every build, and
+// make OPTS="-Ofast -DFASTMATH_LIBMVEC=0" runs the ops on them on x86-64.
+// FASTMATH_*_ULP are the bounds of whichever version was compiled in; the
+// libmvec ones were measured on glibc 2.36 over the same ranges as the
+// polynomials.
+#ifndef FASTMATH_LIBMVEC
+#if defined(__GLIBC__) && defined(__x86_64__) && defined(__FAST_MATH__)
+#define FASTMATH_LIBMVEC 1
+#else
+#define FASTMATH_LIBMVEC 0
+#endif
+#endif
+#if FASTMATH_LIBMVEC
+#define FASTMATH_LIBMVEC_TANH __GLIBC_PREREQ(2, 35)
+#else
+#define FASTMATH_LIBMVEC_TANH 0
+#endif
+
+#define FASTMATH_EXP_ULP (FASTMATH_LIBMVEC ? 3 : 2.5)
+#define FASTMATH_LOG_ULP (FASTMATH_LIBMVEC ? 4 : 5)
+#define FASTMATH_TANH_ULP (FASTMATH_LIBMVEC_TANH ? 1.5 : 2.5)
+
+static inline float simd_expf(float x)
+{
+#if FASTMATH_LIBMVEC
+    return expf(x);
+#else
+    return fast_expf(x);
+#endif
+}
+
+static inline float simd_logf(float x)
+{
+#if FASTMATH_LIBMVEC
+    return logf(x);
+#else
+    return fast_logf(x);
+#endif
+}
+
+static inline float simd_tanhf(float x)
+{
+#if FASTMATH_LIBMVEC_TANH
+    return tanhf(x);
+#else
+    return fast_tanhf(x);
+#endif
+}
+
+// Within 6 ulp where the result is a normal float
+static inline float simd_sigmoidf(float x)
+{
+    return 1.f/(1.f + simd_expf(-x));
+}
+
+// The tanh form 0.5 x (1 + tanh(sqrt(2/pi) (x + 0.044715 x^3))), written
+// as x sigmoid(2u) so the negative side doesn't cancel. The rounding of u
+// is amplified by 2|u| in the left tail: within 5 ulp for x >= -1 and 10 ulp
+// for x >= -2, further left the absolute error stays below 3e-8.
+static inline float simd_geluf(float x)
+{
+    float u = 1.59576912f*(x + .044715f*x*x*x);
+    return x/(1.f + simd_expf(-u));
+}
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,167 @@
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+#include <pthread.h>
+#include "fft.h"
+
+// exp(-2 pi i k / FFT_MAX) for k < FFT_MAX/2, smaller sizes stride through it
+static float fft_twiddle[FFT_MAX];
+static pthread_once_t fft_once = PTHREAD_ONCE_INIT;
+
+static void fft_init()
+{
+    size_t k;
+    for(k = 0; k < FFT_MAX/2; ++k){
+        double a = -2*M_PI*k/FFT_MAX;
+        fft_twiddle[2*k] = cos(a);
+        fft_twiddle[2*k+1] = sin(a);
+    }
+}
+
+static inline int fft_pow2(size_t n)
+{
+    return n && !(n & (n - 1));
+}
+
+void fft(float *d, size_t n, int inverse)
+{
+    size_t i, j, len;
+    assert(fft_pow2(n) && n <= FFT_MAX);
+    pthread_once(&fft_once, fft_init);
+
+    for(i = 1, j = 0; i < n; ++i){
+        size_t bit = n >> 1;
+        for(; j & bit; bit >>= 1) j ^= bit;
+        j |= bit;
+        if(i < j){
+            float r = d[2*i], m = d[2*i+1];
+            d[2*i] = d[2*j];
+            d[2*i+1] = d[2*j+1];
+            d[2*j] = r;
+            d[2*j+1] = m;
+        }
+    }
+
+    float sign = inverse ? -1 : 1;
+    for(len = 2; len <= n; len <<= 1){
+        size_t half = len/2;
+        size_t step = FFT_MAX/len;
+        for(i = 0; i < n; i += len){
+            float *a = d + 2*i;
+            float *b = a + 2*half;
+            for(j = 0; j < half; ++j){
+                float wr = fft_twiddle[2*j*step];
+                float wi = sign*fft_twiddle[2*j*step+1];
+                float vr = b[2*j]*wr - b[2*j+1]*wi;
+                float vi = b[2*j]*wi + b[2*j+1]*wr;
+                b[2*j] = a[2*j] - vr;
+                b[2*j+1] = a[2*j+1] - vi;
+                a[2*j] += vr;
+                a[2*j+1] += vi;
+            }
+        }
+    }
+}
+
+// A row of w reals is w/2 complex numbers z[n] = x[2n] + i x[2n+1]. One
+// half length FFT of z splits into the spectra of the even and odd samples,
+// which combine into bins 0..w/2. d holds w + 2 floats.
+static void fft_r2c_row(float *d, size_t w)
+{
+    size_t m = w/2;
+    size_t k;
+    fft(d, m, 0);
+    float z0r = d[0], z0i = d[1];
+    d[0] = z0r + z0i;
+    d[1] = 0;
+    d[2*m] = z0r - z0i;
+    d[2*m+1] = 0;
+    for(k = 1; k <= m/2; ++k){
+        size_t j = m - k;
+        float ar = d[2*k], ai = d[2*k+1];
+        float br = d[2*j], bi = d[2*j+1];
+        // Even and odd spectra at k
+        float er = .5f*(ar + br), ei = .5f*(ai - bi);
+        float or_ = .5f*(ai + bi), oi = -.5f*(ar - br);
+        float wr = fft_twiddle[2*k*(FFT_MAX/w)];
+        float wi = fft_twiddle[2*k*(FFT_MAX/w)+1];
+        float tr = wr*or_ - wi*oi;
+        float ti = wr*oi + wi*or_;
+        d[2*k] = er + tr;
+        d[2*k+1] = ei + ti;
+        d[2*j] = er - tr;
+        d[2*j+1] = -(ei - ti);
+    }
+}
+
+// Inverse of fft_r2c_row times w, leaves the w reals at the start of d
+static void fft_c2r_row(float *d, size_t w)
+{
+    size_t m = w/2;
+    size_t k;
+    float x0 = d[0], xm = d[2*m];
+    d[0] = x0 + xm;
+    d[1] = x0 - xm;
+    for(k = 1; k <= m/2; ++k){
+        size_t j = m - k;
+        float ar = d[2*k], ai = d[2*k+1];
+        float br = d[2*j], bi = d[2*j+1];
+        // Twice the even and odd spectra at k
+        float er = ar + br, ei = ai - bi;
+        float dr = ar - br, di = ai + bi;
+        float wr = fft_twiddle[2*k*(FFT_MAX/w)];
+        float wi = -fft_twiddle[2*k*(FFT_MAX/w)+1];
+        float or_ = dr*wr - di*wi;
+        float oi = dr*wi + di*wr;
+        // z[k] = e + i o and z[m-k] = conj(e) + i conj(o)
+        d[2*k] = er - oi;
+        d[2*k+1] = ei + or_;
+        d[2*j] = er + oi;
+        d[2*j+1] = -ei + or_;
+    }
+    fft(d, m, 1);
+}
+
+static void fft_columns(float *d, size_t h, size_t cols, int inverse, float *work)
+{
+    size_t c, y;
+    for(c = 0; c < cols; ++c){
+        for(y = 0; y < h; ++y){
+            work[2*y] = d[2*(y*cols + c)];
+            work[2*y+1] = d[2*(y*cols + c)+1];
+        }
+        fft(work, h, inverse);
+        for(y = 0; y < h; ++y){
+            d[2*(y*cols + c)] = work[2*y];
+            d[2*(y*cols + c)+1] = work[2*y+1];
+        }
+    }
+}
+
+void fft2d_r2c(const float *in, size_t h, size_t w, float *out, float *work)
+{
+    size_t cols = w/2 + 1;
+    size_t y;
+    assert(w >= 2 && fft_pow2(w) && w <= FFT_MAX);
+    pthread_once(&fft_once, fft_init);
+    for(y = 0; y < h; ++y){
+        float *row = out + 2*y*cols;
+        memcpy(row, in + y*w, w*sizeof(float));
+        fft_r2c_row(row, w);
+    }
+    fft_columns(out, h, cols, 0, work);
+}
+
+void fft2d_c2r(float *in, size_t h, size_t w, float *out, float *work)
+{
+    size_t cols = w/2 + 1;
+    size_t y;
+    assert(w >= 2 && fft_pow2(w) && w <= FFT_MAX);
+    pthread_once(&fft_once, fft_init);
+    fft_columns(in, h, cols, 1, work);
+    for(y = 0; y < h; ++y){
+        float *row = in + 2*y*cols;
+        fft_c2r_row(row, w);
+        memcpy(out + y*w, row, w*sizeof(float));
+    }
+}
@@ -0,0 +1,26 @@
+// Include guards and C++ compatibility
+#ifndef FFT_H
+#define FFT_H
+#include <stddef.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Radix-2 FFTs on interleaved (re, im) float pairs. Sizes are powers of two
+// up to FFT_MAX. Transforms are unnormalized: inverse(forward(x)) = n x.
+
+#define FFT_MAX 4096
+
+void fft(float *data, size_t n, int inverse);
+
+// Real 2-D FFT of an h x w row-major image, w >= 2. The spectrum is
+// h x (w/2 + 1) complex bins, the other half follows from symmetry.
+// work holds at least 2*h floats.
+void fft2d_r2c(const float *in, size_t h, size_t w, float *out, float *work);
+// Inverse of fft2d_r2c times h*w. Overwrites the spectrum in.
+void fft2d_c2r(float *in, size_t h, size_t w, float *out, float *work);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
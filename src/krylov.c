@@ -0,0 +1,261 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <math.h>
+#include "krylov.h"
+#include "prof.h"
+
+solver_opts solver_defaults()
+{
+    solver_opts opts = {0};
+    opts.tol = 1e-5;
+    return opts;
+}
+
+void matvec_dense(void *ctx, const float *x, float *y)
+{
+    tensor *A = ctx;
+    size_t n = A->size[0];
+    size_t i;
+    #pragma omp parallel for schedule(static)
+    for(i = 0; i < n; ++i){
+        const float *row = A->data + i*n;
+        size_t j;
+        float sum = 0;
+        for(j = 0; j < n; ++j){
+            sum += row[j]*x[j];
+        }
+        y[i] = sum;
+    }
+}
+
+// Dot products accumulate in double, the residual test depends on them
+static double krylov_dot(const float *x, const float *y, size_t n)
+{
+    double sum = 0;
+    size_t i;
+    #pragma omp parallel for reduction(+:sum) schedule(static)
+    for(i = 0; i < n; ++i){
+        sum += (double)x[i]*y[i];
+    }
+    return sum;
+}
+
+static void krylov_axpy(double a, const float *x, float *y, size_t n)
+{
+    size_t i;
+    #pragma omp parallel for schedule(static)
+    for(i = 0; i < n; ++i){
+        y[i] += a*x[i];
+    }
+}
+
+// z = M^-1 r for the Jacobi preconditioner, or a copy without one. Zero
+// diagonal entries, which a nonsingular A can have, count as 1.
+static void krylov_precondition(const float *diag, const float *r, float *z, size_t n)
+{
+    size_t i;
+    #pragma omp parallel for schedule(static)
+    for(i = 0; i < n; ++i){
+        z[i] = diag && diag[i] != 0 ? r[i] / diag[i] : r[i];
+    }
+}
+
+static const float *krylov_diag(solver_opts opts)
+{
+    if(!opts.jacobi) return 0;
+    if(!opts.diag) fprintf(stderr, "Jacobi preconditioning needs a diagonal, ignoring\n");
+    return opts.diag;
+}
+
+tensor solve_cg_op(size_t n, matvec_fn matvec, void *ctx, tensor b, solver_opts opts, solver_stats *stats)
+{
+    assert(tensor_len(b) == n);
+    PROF_BEGIN(start);
+    size_t max_iter = opts.max_iter ? opts.max_iter : 10*n;
+    const float *diag = krylov_diag(opts);
+    tensor x = tensor_make(b.n, b.size);
+    float *r = calloc(n, sizeof(float));
+    float *z = calloc(n, sizeof(float));
+    float *p = calloc(n, sizeof(float));
+    float *Ap = calloc(n, sizeof(float));
+    size_t i, it = 0;
+
+    // x = 0, so r = b
+    for(i = 0; i < n; ++i) r[i] = b.data[i];
+    double bnorm = sqrt(krylov_dot(b.data, b.data, n));
+    if(bnorm == 0) bnorm = 1;
+    double rnorm = sqrt(krylov_dot(r, r, n));
+    krylov_precondition(diag, r, z, n);
+    for(i = 0; i < n; ++i) p[i] = z[i];
+    double rz = krylov_dot(r, z, n);
+
+    while(rnorm / bnorm > opts.tol && it < max_iter){
+        matvec(ctx, p, Ap);
+        ++it;
+        double pAp = krylov_dot(p, Ap, n);
+        if(pAp <= 0) break;  // A is not positive definite along p
+        // Step sizes stay in double like the dot products they come from
+        double alpha = rz / pAp;
+        krylov_axpy(alpha, p, x.data, n);
+        krylov_axpy(-alpha, Ap, r, n);
+        rnorm = sqrt(krylov_dot(r, r, n));
+        krylov_precondition(diag, r, z, n);
+        double rz_new = krylov_dot(r, z, n);
+        double beta = rz_new / rz;
+        rz = rz_new;
+        #pragma omp parallel for schedule(static)
+        for(i = 0; i < n; ++i){
+            p[i] = z[i] + beta*p[i];
+        }
+    }
+
+    if(stats){
+        stats->iterations = it;
+        stats->residual = rnorm / bnorm;
+        stats->converged = rnorm / bnorm <= opts.tol;
+    }
+    free(r);
+    free(z);
+    free(p);
+    free(Ap);
+    PROF_END(PROF_SOLVE_CG, start, 0);
+    return x;
+}
+
+tensor solve_gmres_op(size_t n, matvec_fn matvec, void *ctx, tensor b, solver_opts opts, solver_stats *stats)
+{
+    assert(tensor_len(b) == n);
+    PROF_BEGIN(start);
+    size_t max_iter = opts.max_iter ? opts.max_iter : 10*n;
+    size_t m = opts.restart ? opts.restart : 30;
+    const float *diag = krylov_diag(opts);
+    tensor x = tensor_make(b.n, b.size);
+    float *V = calloc((m + 1)*n, sizeof(float));
+    float *w = calloc(n, sizeof(float));
+    float *z = calloc(n, sizeof(float));
+    double *H = calloc((m + 1)*m, sizeof(double));
+    double *cs = calloc(m, sizeof(double));
+    double *sn = calloc(m, sizeof(double));
+    double *g = calloc(m + 1, sizeof(double));
+    double *y = calloc(m, sizeof(double));
+    size_t i, j, k, it = 0;
+    int converged = 0;
+
+    double bnorm = sqrt(krylov_dot(b.data, b.data, n));
+    if(bnorm == 0) bnorm = 1;
+    double resid = 0;
+
+    // Right preconditioning: solve A M^-1 u = b, then x = M^-1 u, so the
+    // residual being minimized is the true one
+    while(1){
+        matvec(ctx, x.data, w);
+        for(i = 0; i < n; ++i) w[i] = b.data[i] - w[i];
+        double beta = sqrt(krylov_dot(w, w, n));
+        resid = beta / bnorm;
+        if(resid <= opts.tol){
+            converged = 1;
+            break;
+        }
+        if(it >= max_iter) break;
+
+        for(i = 0; i < n; ++i) V[i] = w[i] / beta;
+        for(i = 0; i <= m; ++i) g[i] = 0;
+        g[0] = beta;
+
+        for(k = 0; k < m && it < max_iter; ){
+            float *vk = V + k*n;
+            float *vnext = V + (k+1)*n;
+            krylov_precondition(diag, vk, z, n);
+            matvec(ctx, z, vnext);
+            ++it;
+
+            // Modified Gram-Schmidt against the basis so far
+            for(j = 0; j <= k; ++j){
+                double h = krylov_dot(vnext, V + j*n, n);
+                H[j*m + k] = h;
+                krylov_axpy(-h, V + j*n, vnext, n);
+            }
+            double h = sqrt(krylov_dot(vnext, vnext, n));
+            H[(k+1)*m + k] = h;
+            if(h > 0){
+                for(i = 0; i < n; ++i) vnext[i] /= h;
+            }
+
+            // Givens rotations keep H upper triangular
+            for(j = 0; j < k; ++j){
+                double a = H[j*m + k];
+                double c = H[(j+1)*m + k];
+                H[j*m + k] = cs[j]*a + sn[j]*c;
+                H[(j+1)*m + k] = -sn[j]*a + cs[j]*c;
+            }
+            double a = H[k*m + k];
+            double c = H[(k+1)*m + k];
+            double r = sqrt(a*a + c*c);
+            cs[k] = r > 0 ? a / r : 1;
+            sn[k] = r > 0 ? c / r : 0;
+            H[k*m + k] = r;
+            H[(k+1)*m + k] = 0;
+            g[k+1] = -sn[k]*g[k];
+            g[k] = cs[k]*g[k];
+            ++k;
+
+            resid = fabs(g[k]) / bnorm;
+            if(resid <= opts.tol || h == 0) break;
+        }
+
+        // Back substitution for y, then x += M^-1 V y
+        for(i = k; i-- > 0; ){
+            double sum = g[i];
+            for(j = i + 1; j < k; ++j) sum -= H[i*m + j]*y[j];
+            y[i] = H[i*m + i] != 0 ? sum / H[i*m + i] : 0;
+        }
+        for(i = 0; i < n; ++i) w[i] = 0;
+        for(j = 0; j < k; ++j) krylov_axpy(y[j], V + j*n, w, n);
+        krylov_precondition(diag, w, z, n);
+        krylov_axpy(1, z, x.data, n);
+    }
+
+    if(stats){
+        stats->iterations = it;
+        stats->residual = resid;
+        stats->converged = converged;
+    }
+    free(V);
+    free(w);
+    free(z);
+    free(H);
+    free(cs);
+    free(sn);
+    free(g);
+    free(y);
+    PROF_END(PROF_SOLVE_GMRES, start, 0);
+    return x;
+}
+
+static tensor krylov_dense(tensor A, tensor b, solver_opts opts, solver_stats *stats, int gmres)
+{
+    assert(A.n == 2);
+    assert(A.size[0] == A.size[1]);
+    size_t n = A.size[0];
+    float *diag = 0;
+    size_t i;
+    if(opts.jacobi && !opts.diag){
+        diag = calloc(n, sizeof(float));
+        for(i = 0; i < n; ++i) diag[i] = A.data[i*n + i];
+        opts.diag = diag;
+    }
+    tensor x = gmres ? solve_gmres_op(n, matvec_dense, &A, b, opts, stats)
+                     : solve_cg_op(n, matvec_dense, &A, b, opts, stats);
+    free(diag);
+    return x;
+}
+
+tensor solve_cg(tensor A, tensor b, solver_opts opts, solver_stats *stats)
+{
+    return krylov_dense(A, b, opts, stats, 0);
+}
+
+tensor solve_gmres(tensor A, tensor b, solver_opts opts, solver_stats *stats)
+{
+    return krylov_dense(A, b, opts, stats, 1);
+}
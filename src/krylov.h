@@ -0,0 +1,46 @@
+// Include guards and C++ compatibility
+#ifndef KRYLOV_H
+#define KRYLOV_H
+#include "tensor.h"
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Iterative solvers for A x = b. Conjugate gradient needs A symmetric
+// positive definite, restarted GMRES takes any nonsingular A. Both touch A
+// only through y = A x, so memory is the operator plus a few (CG) or
+// restart + 1 (GMRES) vectors of length n.
+
+typedef void (*matvec_fn)(void *ctx, const float *x, float *y);
+
+typedef struct solver_opts {
+    size_t max_iter;    // Matrix-vector products allowed, 0 means 10n
+    float tol;          // Stop when ||b - A x|| / ||b|| falls below
+    size_t restart;     // GMRES Krylov dimension, 0 means 30
+    int jacobi;         // Precondition with the diagonal of A, zeros count as 1
+    const float *diag;  // Diagonal for the operator versions, when jacobi
+} solver_opts;
+
+typedef struct solver_stats {
+    size_t iterations;
+    float residual;     // Relative residual when the solver stopped
+    int converged;
+} solver_stats;
+
+solver_opts solver_defaults();
+
+// Dense versions, A is n x n and b has n elements, x comes back shaped like b
+tensor solve_cg(tensor A, tensor b, solver_opts opts, solver_stats *stats);
+tensor solve_gmres(tensor A, tensor b, solver_opts opts, solver_stats *stats);
+
+// Operator versions, for csr matrices pass matvec_csr with a csr * as ctx
+tensor solve_cg_op(size_t n, matvec_fn matvec, void *ctx, tensor b, solver_opts opts, solver_stats *stats);
+tensor solve_gmres_op(size_t n, matvec_fn matvec, void *ctx, tensor b, solver_opts opts, solver_stats *stats);
+
+// y = A x for a dense n x n tensor, ctx is a tensor *
+void matvec_dense(void *ctx, const float *x, float *y);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
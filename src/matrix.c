@@ -1,10 +1,155 @@
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
 #include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include "matrix.h"
+#include "prof.h"
+#include "tune.h"
 
-tensor matrix_multiply(const tensor a, const tensor b)
+#define MIN(a,b) (((a)<(b))?(a):(b))
+#define MAX(a,b) (((a)>(b))?(a):(b))
+
+// Lanes per dot product accumulator, rows per GEMV block, columns per
+// vector-matrix chunk, and the smallest M*K or K*N worth threads
+#define DOT_LANES 8
+#define GEMV_ROWS 4
+#define VECMAT_COLS 1024
+#define SKINNY_PARALLEL_MIN (1 << 16)
+
+// Lane l of a row's accumulator sums the terms k = l mod DOT_LANES in k
+// order. Operations on vector types are lane by lane, so the compiler maps
+// them straight onto SIMD registers (two SSE registers without -march) and
+// has no reduction to reorder; the scalar adds after them are pinned.
+typedef float dot_lanes __attribute__((vector_size(DOT_LANES*sizeof(float))));
+
+// Vectors go through pointers, not by value, so the helpers keep the same
+// ABI with or without AVX
+static inline void dot_load_(dot_lanes *v, const float *p)
+{
+    memcpy(v, p, sizeof(*v));
+}
+
+// Passes s through an empty asm. -Ofast may regroup a chain of scalar adds
+// however it likes, and differently wherever the chain is inlined; a value
+// it cannot see into ends the chain.
+static inline float dot_pin_(float s)
+{
+    __asm__("" : "+g"(s));
+    return s;
+}
+
+// Lanes folded in halves, (l + l+4), then (l + l+2), then (0 + 1)
+static inline float dot_sum_(const dot_lanes *v)
+{
+    float h[DOT_LANES/2], q[DOT_LANES/4];
+    size_t l;
+    for(l = 0; l < DOT_LANES/2; ++l) h[l] = dot_pin_((*v)[l] + (*v)[l + DOT_LANES/2]);
+    for(l = 0; l < DOT_LANES/4; ++l) q[l] = dot_pin_(h[l] + h[l + DOT_LANES/4]);
+    return dot_pin_(q[0] + q[1]);
+}
+
+// y[r] += a[r].b[r] for rows rows of a and b, lda and ldb apart; ldb 0 dots
+// every row with the same vector. The rows share each load of a shared b
+// and keep independent accumulators in flight. Terms past the last full
+// group of lanes are added to the folded lanes in k order, then the sum to
+// y[r]. rows is a constant at every call, so the accumulators stay in
+// registers.
+static inline void dot_rows_(const float *a, size_t lda, const float *b, size_t ldb,
+        size_t K, size_t rows, float *y)
+{
+    dot_lanes acc[GEMV_ROWS];
+    size_t K8 = K - K%DOT_LANES;
+    size_t r, k;
+    for(r = 0; r < rows; ++r) acc[r] = (dot_lanes){0};
+    for(k = 0; k < K8; k += DOT_LANES){
+        dot_lanes ak, bk;
+        dot_load_(&bk, b + k);
+        for(r = 0; r < rows; ++r){
+            if(ldb) dot_load_(&bk, b + r*ldb + k);
+            dot_load_(&ak, a + r*lda + k);
+            acc[r] += ak*bk;
+        }
+    }
+    for(r = 0; r < rows; ++r){
+        float sum = dot_sum_(&acc[r]);
+        for(k = K8; k < K; ++k) sum = dot_pin_(sum + a[r*lda + k]*b[r*ldb + k]);
+        y[r] += sum;
+    }
+}
+
+// y[i] += a[i].b[i] for M rows, blocks of GEMV_ROWS spread over threads
+static void dot_(const float *a, size_t lda, const float *b, size_t ldb, size_t M, size_t K, float *y)
+{
+    size_t nblocks = M/GEMV_ROWS;
+    size_t i;
+    #pragma omp parallel for schedule(static) if(M*K >= SKINNY_PARALLEL_MIN)
+    for(i = 0; i < nblocks; ++i){
+        dot_rows_(a + i*GEMV_ROWS*lda, lda, b + i*GEMV_ROWS*ldb, ldb, K, GEMV_ROWS, y + i*GEMV_ROWS);
+    }
+    for(i = nblocks*GEMV_ROWS; i < M; ++i){
+        dot_rows_(a + i*lda, lda, b + i*ldb, ldb, K, 1, y + i);
+    }
+}
+
+// y += x*b for a K x N matrix b, in column chunks that stay in L1 while
+// every row of b streams through once
+static void vecmat_(const float *x, const float *b, size_t K, size_t N, float *y)
+{
+    size_t nchunks = (N + VECMAT_COLS - 1)/VECMAT_COLS;
+    size_t c;
+    #pragma omp parallel for schedule(static) if(K*N >= SKINNY_PARALLEL_MIN)
+    for(c = 0; c < nchunks; ++c){
+        size_t j0 = c*VECMAT_COLS;
+        size_t j1 = MIN(j0 + VECMAT_COLS, N);
+        size_t j, k;
+        float *yc = y + j0;
+        for(k = 0; k < K; ++k){
+            float xk = x[k];
+            const float *brow = b + k*N + j0;
+            for(j = 0; j < j1 - j0; ++j) yc[j] += xk*brow[j];
+        }
+    }
+}
+
+// Accumulates a*b into t, walking b in bk x bn panels that stay in cache.
+// Each output element still sums over k in order, so the result does not
+// depend on the block sizes. Single row products go to the vector-matrix
+// kernel, which keeps that order too, so a product's rows come out the
+// same whatever else is multiplied alongside them.
+void matrix_multiply_blocked_(const tensor a, const tensor b, tensor t, size_t bk, size_t bn)
+{
+    size_t M = a.size[0];
+    size_t K = a.size[1];
+    size_t N = b.size[1];
+    size_t i, j, k, j0, k0;
+    if(M == 1){
+        vecmat_(a.data, b.data, K, N, t.data);
+        return;
+    }
+    for(j0 = 0; j0 < N; j0 += bn){
+        size_t j1 = MIN(j0 + bn, N);
+        for(k0 = 0; k0 < K; k0 += bk){
+            size_t k1 = MIN(k0 + bk, K);
+            for(i = 0; i < M; ++i){
+                float *trow = t.data + i*N;
+                for(k = k0; k < k1; ++k){
+                    float aik = a.data[i*K + k];
+                    const float *brow = b.data + k*N;
+                    for(j = j0; j < j1; ++j){
+                        trow[j] += aik*brow[j];
+                    }
+                }
+            }
+        }
+    }
+}
+
+tensor matrix_multiply_config(const tensor a, const tensor b, gemm_config cfg)
 {
     assert(a.n == 2);
     assert(b.n == 2);
@@ -12,22 +157,237 @@ tensor matrix_multiply(const tensor a, const tensor b)
     size_t M = a.size[0];
     size_t K = a.size[1];
     size_t N = b.size[1];
+    PROF_BEGIN(start);
     size_t size[2] = {M, N};
     tensor t = tensor_make(2, size);
-    size_t i, j, k;
-    for(i = 0; i < M; ++i){
-        for(k = 0; k < K; ++k){
-            for(j = 0; j < N; ++j){
-                t.data[i*N + j] += a.data[i*K + k]*b.data[k*N + j];
+    if(N == 1) dot_(a.data, K, b.data, 0, M, K, t.data);
+    else matrix_multiply_blocked_(a, b, t, cfg.bk ? cfg.bk : K, cfg.bn ? cfg.bn : N);
+    PROF_END(PROF_MATRIX_MULTIPLY, start, 2.0*M*N*K);
+    return t;
+}
+
+void matrix_multiply_into(const tensor a, const tensor b, tensor *t, gemm_config cfg)
+{
+    assert(a.n == 2);
+    assert(b.n == 2);
+    assert(a.size[1] == b.size[0]);
+    assert(tensor_len(*t) == a.size[0]*b.size[1]);
+    size_t M = a.size[0];
+    size_t K = a.size[1];
+    size_t N = b.size[1];
+    PROF_BEGIN(start);
+    tensor_mutable(t);
+    matrix_multiply_blocked_(a, b, *t, cfg.bk ? cfg.bk : K, cfg.bn ? cfg.bn : N);
+    PROF_END(PROF_MATRIX_MULTIPLY, start, 2.0*M*N*K);
+}
+
+tensor matrix_multiply(const tensor a, const tensor b)
+{
+    assert(a.n == 2);
+    assert(b.n == 2);
+    return matrix_multiply_config(a, b, tune_gemm(a.size[0], a.size[1], b.size[1]));
+}
+
+// Default memory for matrix_multiply_ooc tiles and panels
+#define MATRIX_OOC_BUDGET (256 << 20)
+
+// One step of matrix_multiply_ooc: tile rows [i0, i1) x cols [j0, j1) of
+// the output, k-panel [k0, k1), packed into abuf and bbuf
+typedef struct ooc_step {
+    tensor a, b;
+    size_t i0, i1, j0, j1, k0, k1;
+    float *abuf, *bbuf;
+} ooc_step;
+
+static void ooc_step_at_(ooc_step *st, size_t s, size_t mr, size_t nc, size_t kc)
+{
+    size_t M = st->a.size[0];
+    size_t K = st->a.size[1];
+    size_t N = st->b.size[1];
+    size_t nk = (K + kc - 1)/kc;
+    size_t nj = (N + nc - 1)/nc;
+    st->k0 = s%nk*kc;
+    st->j0 = s/nk%nj*nc;
+    st->i0 = s/(nk*nj)*mr;
+    st->k1 = MIN(st->k0 + kc, K);
+    st->j1 = MIN(st->j0 + nc, N);
+    st->i1 = MIN(st->i0 + mr, M);
+}
+
+// Asks the kernel to start reading len floats at p
+static void ooc_prefetch_(const float *p, size_t len)
+{
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t lo = (uintptr_t)p & ~(page - 1);
+    madvise((void *)lo, (uintptr_t)(p + len) - lo, MADV_WILLNEED);
+}
+
+// Queues reads for every row of both panels first, so the disk sees them
+// all at once, then packs them while the faults come back
+static void ooc_load_(ooc_step *st)
+{
+    size_t K = st->a.size[1];
+    size_t N = st->b.size[1];
+    size_t kc = st->k1 - st->k0;
+    size_t nc = st->j1 - st->j0;
+    size_t i, k;
+    for(i = st->i0; i < st->i1; ++i) ooc_prefetch_(st->a.data + i*K + st->k0, kc);
+    for(k = st->k0; k < st->k1; ++k) ooc_prefetch_(st->b.data + k*N + st->j0, nc);
+    for(i = st->i0; i < st->i1; ++i){
+        memcpy(st->abuf + (i - st->i0)*kc, st->a.data + i*K + st->k0, kc*sizeof(float));
+    }
+    for(k = st->k0; k < st->k1; ++k){
+        memcpy(st->bbuf + (k - st->k0)*nc, st->b.data + k*N + st->j0, nc*sizeof(float));
+    }
+}
+
+// Two slot handoff between the read-ahead thread and the multiply. Step n
+// lives in slot n%2, and the reader may run one step ahead of the multiply.
+typedef struct ooc_loader {
+    ooc_step slots[2];
+    size_t mr, nc, kc;
+    size_t nsteps;
+    size_t loaded;          // Steps packed so far, under lock
+    size_t consumed;        // Steps multiplied so far, under lock
+    pthread_mutex_t lock;
+    pthread_cond_t cond;    // Broadcast when either count moves
+} ooc_loader;
+
+static void *ooc_read_ahead_(void *ctx)
+{
+    ooc_loader *l = ctx;
+    size_t n;
+    for(n = 0; n < l->nsteps; ++n){
+        pthread_mutex_lock(&l->lock);
+        while(n >= l->consumed + 2) pthread_cond_wait(&l->cond, &l->lock);
+        pthread_mutex_unlock(&l->lock);
+
+        ooc_step *st = &l->slots[n%2];
+        ooc_step_at_(st, n, l->mr, l->nc, l->kc);
+        ooc_load_(st);
+
+        pthread_mutex_lock(&l->lock);
+        l->loaded = n + 1;
+        pthread_cond_broadcast(&l->cond);
+        pthread_mutex_unlock(&l->lock);
+    }
+    return 0;
+}
+
+// Tiles are s x s with s/4 deep panels, so the output tile and two sets of
+// panels take 2*s*s floats
+void matrix_multiply_ooc(const tensor a, const tensor b, tensor *t, size_t budget)
+{
+    assert(a.n == 2);
+    assert(b.n == 2);
+    assert(a.size[1] == b.size[0]);
+    assert(tensor_len(*t) == a.size[0]*b.size[1]);
+    size_t M = a.size[0];
+    size_t K = a.size[1];
+    size_t N = b.size[1];
+    PROF_BEGIN(start);
+    float *tdata = tensor_mutable(t);
+    size_t s = sqrt((budget ? budget : MATRIX_OOC_BUDGET)/(2*sizeof(float)));
+    s = MAX(s, 4);
+    ooc_loader l;
+    memset(&l, 0, sizeof(l));
+    l.mr = MIN(M, s);
+    l.nc = MIN(N, s);
+    l.kc = MIN(K, s/4);
+    l.nsteps = (M + l.mr - 1)/l.mr*((N + l.nc - 1)/l.nc)*((K + l.kc - 1)/l.kc);
+    gemm_config cfg = tune_gemm(l.mr, l.kc, l.nc);
+    float *cbuf = malloc(l.mr*l.nc*sizeof(float));
+    size_t i, n;
+    for(i = 0; i < 2; ++i){
+        l.slots[i].a = a;
+        l.slots[i].b = b;
+        l.slots[i].abuf = malloc(l.mr*l.kc*sizeof(float));
+        l.slots[i].bbuf = malloc(l.kc*l.nc*sizeof(float));
+    }
+    pthread_mutex_init(&l.lock, 0);
+    pthread_cond_init(&l.cond, 0);
+    pthread_t reader;
+    int async = pthread_create(&reader, 0, ooc_read_ahead_, &l) == 0;
+
+    for(n = 0; n < l.nsteps; ++n){
+        ooc_step *st = &l.slots[n%2];
+        if(async){
+            pthread_mutex_lock(&l.lock);
+            while(l.loaded <= n) pthread_cond_wait(&l.cond, &l.lock);
+            pthread_mutex_unlock(&l.lock);
+        } else {
+            ooc_step_at_(st, n, l.mr, l.nc, l.kc);
+            ooc_load_(st);
+        }
+
+        size_t rows = st->i1 - st->i0;
+        size_t cols = st->j1 - st->j0;
+        size_t depth = st->k1 - st->k0;
+        size_t as[2] = {rows, depth};
+        size_t bs[2] = {depth, cols};
+        size_t cs[2] = {rows, cols};
+        tensor va = {2, as, st->abuf, 0};
+        tensor vb = {2, bs, st->bbuf, 0};
+        tensor vc = {2, cs, cbuf, 0};
+        if(st->k0 == 0) memset(cbuf, 0, rows*cols*sizeof(float));
+        matrix_multiply_blocked_(va, vb, vc, cfg.bk ? MIN(cfg.bk, depth) : depth,
+                cfg.bn ? MIN(cfg.bn, cols) : cols);
+        if(st->k1 == K){
+            for(i = 0; i < rows; ++i){
+                memcpy(tdata + (st->i0 + i)*N + st->j0, cbuf + i*cols, cols*sizeof(float));
             }
         }
+
+        if(async){
+            pthread_mutex_lock(&l.lock);
+            l.consumed = n + 1;
+            pthread_cond_broadcast(&l.cond);
+            pthread_mutex_unlock(&l.lock);
+        }
     }
-    return t;
+
+    if(async) pthread_join(reader, 0);
+    pthread_mutex_destroy(&l.lock);
+    pthread_cond_destroy(&l.cond);
+    for(i = 0; i < 2; ++i){
+        free(l.slots[i].abuf);
+        free(l.slots[i].bbuf);
+    }
+    free(cbuf);
+    PROF_END(PROF_MATRIX_MULTIPLY_OOC, start, 2.0*M*N*K);
+}
+
+tensor matrix_gemv(const tensor a, const tensor x)
+{
+    assert(a.n == 2);
+    assert(tensor_len(x) == a.size[1]);
+    size_t M = a.size[0];
+    size_t K = a.size[1];
+    PROF_BEGIN(start);
+    tensor y = tensor_vmake(1, M);
+    dot_(a.data, K, x.data, 0, M, K, y.data);
+    PROF_END(PROF_GEMV, start, 2.0*M*K);
+    return y;
+}
+
+tensor matrix_batch_dot(const tensor a, const tensor b)
+{
+    assert(a.n == 2);
+    assert(b.n == 2);
+    assert(a.size[0] == b.size[0] && a.size[1] == b.size[1]);
+    size_t M = a.size[0];
+    size_t K = a.size[1];
+    PROF_BEGIN(start);
+    tensor y = tensor_vmake(1, M);
+    dot_(a.data, K, b.data, K, M, K, y.data);
+    PROF_END(PROF_BATCH_DOT, start, 2.0*M*K);
+    return y;
 }
 
 tensor matrix_transpose(tensor a)
 {
     assert(a.n == 2);
+    PROF_BEGIN(start);
     size_t size[2] = {a.size[1], a.size[0]};
     tensor t = tensor_make(2, size);
 
@@ -40,6 +400,7 @@ tensor matrix_transpose(tensor a)
         }
     }
 
+    PROF_END(PROF_TRANSPOSE, start, 0);
     return t;
 }
 
@@ -69,6 +430,7 @@ tensor matrix_invert(tensor m)
     //print_matrix(m);
     assert(m.n == 2);
     assert(m.size[0] == m.size[1]);
+    PROF_BEGIN(start);
 
     tensor c = augment_matrix(m);
     tensor none = {0};
@@ -130,12 +492,14 @@ tensor matrix_invert(tensor m)
     tensor_free(c);
     free(cdata);
     //print_matrix(inv);
+    PROF_END(PROF_INVERT, start, 2.0*m.size[0]*m.size[0]*m.size[0]);
     return inv;
 }
 
 tensor solve_system(tensor M, tensor b)
 {
     tensor none = {0};
+    PROF_BEGIN(start);
     tensor Mt = matrix_transpose(M);
     tensor MtM = matrix_multiply(Mt, M);
     tensor MtMinv = matrix_invert(MtM);
@@ -146,5 +510,6 @@ tensor solve_system(tensor M, tensor b)
     tensor_free(MtM);
     tensor_free(MtMinv);
     tensor_free(Mdag);
+    PROF_END(PROF_SOLVE_SYSTEM, start, 0);
     return a;
 }
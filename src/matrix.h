@@ -6,7 +6,45 @@
 extern "C" {
 #endif
 
+// Cache blocking for matrix_multiply, 0 means no blocking along that axis
+typedef struct gemm_config {
+    size_t bk;
+    size_t bn;
+} gemm_config;
+
+// Products with one column go to the matrix_gemv kernel; every other
+// output is summed over k in order.
 tensor matrix_multiply(const tensor a, const tensor b);
+tensor matrix_multiply_config(const tensor a, const tensor b, gemm_config cfg);
+// Accumulates a*b into t, which must already be M x N. Writes through
+// tensor_mutable, so it allocates only when t shares its buffer. Sums over
+// k in order for every shape, one column included, so a band of columns
+// comes out the same as in the whole product.
+void matrix_multiply_into(const tensor a, const tensor b, tensor *t, gemm_config cfg);
+// Writes a*b into t (M x N) for operands that don't fit in memory, such
+// as tensor_mmap tensors. Works on tiles of t that fit in budget bytes
+// (0 picks a default), streaming k-panels of a and b through two packed
+// buffers: one read-ahead thread fills the next panels, with madvise
+// hints, while the current ones multiply. Finished tiles are written out
+// in row order, through tensor_mutable. Clean file pages can be dropped
+// without touching swap, so the run is bound by disk reads, about
+// 4*M*N*K*(1/tile_rows + 1/tile_cols) bytes. The result matches
+// matrix_multiply_into bit for bit, and matrix_multiply unless b has one
+// column.
+void matrix_multiply_ooc(const tensor a, const tensor b, tensor *t, size_t budget);
+// Matrix-vector product of an M x K matrix and any tensor of K elements,
+// returned as a vector of M. Each row sums in 8 lanes, lane l taking
+// k = l mod 8 in order; the lanes fold pairwise, (l, l+4), (l, l+2),
+// (0, 1), and the last K mod 8 terms are added after in order. That is at
+// most K/8 + 10 rounded adds per row against K in order, so a row is
+// within gamma(K/8 + 10)*sum|a_k x_k| of the exact dot product, gamma(n)
+// = n*u/(1 - n*u) with u = 2^-24, and may differ from the in-order sum
+// by a few ulps of that magnitude.
+tensor matrix_gemv(const tensor a, const tensor x);
+// Row-wise dot products of two M x K matrices, returned as a vector of M.
+// Same kernel and bound as matrix_gemv: a row of b equal to x gives the
+// matrix_gemv row bit for bit.
+tensor matrix_batch_dot(const tensor a, const tensor b);
 tensor matrix_transpose(const tensor a);
 tensor matrix_invert(tensor m);
 tensor solve_system(tensor M, tensor b);
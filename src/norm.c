@@ -0,0 +1,149 @@
+#include <assert.h>
+#include <math.h>
+#include "norm.h"
+#include "fastmath.h"
+#include "prof.h"
+
+#define MIN(a,b) (((a)<(b))?(a):(b))
+#define MAX(a,b) (((a)>(b))?(a):(b))
+
+// Columns per step of the online max and sum, small enough to stay in L1
+// between the max and the exp loop. Very long rows use up to NORM_CHUNKS
+// bigger chunks so softmax can keep one max per chunk on the stack.
+#define NORM_CHUNK 256
+#define NORM_CHUNKS 64
+
+// Max of a row and the sum of exp(x - max), in one pass over memory
+static void norm_online_(const float *x, size_t n, float *max, float *sum)
+{
+    float m = x[0];
+    float s = 0;
+    size_t j0, j;
+    for(j0 = 0; j0 < n; j0 += NORM_CHUNK){
+        size_t j1 = MIN(j0 + NORM_CHUNK, n);
+        float cm = x[j0];
+        for(j = j0; j < j1; ++j) cm = x[j] > cm ? x[j] : cm;
+        if(cm > m){
+            s *= simd_expf(m - cm);
+            m = cm;
+        }
+        float cs = 0;
+        for(j = j0; j < j1; ++j) cs += simd_expf(x[j] - m);
+        s += cs;
+    }
+    *max = m;
+    *sum = s;
+}
+
+// First pass writes exp(x - m) with m the running max at each chunk and
+// remembers that m, the second rescales each chunk by exp(m - max)/sum.
+// One exp per element, one read of x.
+static void norm_softmax_row_(const float *x, float *y, size_t n)
+{
+    float cms[NORM_CHUNKS];
+    size_t chunk = MAX(NORM_CHUNK, (n + NORM_CHUNKS - 1)/NORM_CHUNKS);
+    float m = x[0];
+    float s = 0;
+    size_t c, j0, j;
+    for(c = 0, j0 = 0; j0 < n; ++c, j0 += chunk){
+        size_t j1 = MIN(j0 + chunk, n);
+        float cm = x[j0];
+        for(j = j0; j < j1; ++j) cm = x[j] > cm ? x[j] : cm;
+        if(cm > m){
+            s *= simd_expf(m - cm);
+            m = cm;
+        }
+        float cs = 0;
+        for(j = j0; j < j1; ++j){
+            y[j] = simd_expf(x[j] - m);
+            cs += y[j];
+        }
+        s += cs;
+        cms[c] = m;
+    }
+    float inv = 1.f/s;
+    for(c = 0, j0 = 0; j0 < n; ++c, j0 += chunk){
+        size_t j1 = MIN(j0 + chunk, n);
+        float f = simd_expf(cms[c] - m)*inv;
+        for(j = j0; j < j1; ++j) y[j] *= f;
+    }
+}
+
+tensor tensor_softmax(tensor t)
+{
+    assert(t.n >= 1);
+    PROF_BEGIN(start);
+    tensor r = tensor_make(t.n, t.size);
+    size_t cols = t.size[t.n-1];
+    size_t rows = cols ? tensor_len(t)/cols : 0;
+    size_t i;
+    #pragma omp parallel for schedule(static)
+    for(i = 0; i < rows; ++i){
+        norm_softmax_row_(t.data + i*cols, r.data + i*cols, cols);
+    }
+    PROF_END(PROF_SOFTMAX, start, 0);
+    return r;
+}
+
+tensor tensor_log_softmax(tensor t)
+{
+    assert(t.n >= 1);
+    PROF_BEGIN(start);
+    tensor r = tensor_make(t.n, t.size);
+    size_t cols = t.size[t.n-1];
+    size_t rows = cols ? tensor_len(t)/cols : 0;
+    size_t i;
+    #pragma omp parallel for schedule(static)
+    for(i = 0; i < rows; ++i){
+        const float *x = t.data + i*cols;
+        float *y = r.data + i*cols;
+        float m, s;
+        size_t j;
+        norm_online_(x, cols, &m, &s);
+        float lse = m + logf(s);
+        for(j = 0; j < cols; ++j) y[j] = x[j] - lse;
+    }
+    PROF_END(PROF_LOG_SOFTMAX, start, 0);
+    return r;
+}
+
+tensor tensor_layernorm(tensor t, tensor gamma, tensor beta, float eps)
+{
+    assert(t.n >= 1);
+    size_t cols = t.size[t.n-1];
+    size_t rows = cols ? tensor_len(t)/cols : 0;
+    assert(!gamma.data || tensor_len(gamma) == cols);
+    assert(!beta.data || tensor_len(beta) == cols);
+    PROF_BEGIN(start);
+    tensor r = tensor_make(t.n, t.size);
+    size_t i;
+    #pragma omp parallel for schedule(static)
+    for(i = 0; i < rows; ++i){
+        const float *x = t.data + i*cols;
+        float *y = r.data + i*cols;
+        size_t j;
+        // Sums shifted by the first entry, so a large mean doesn't cancel
+        // the variance away
+        float k = x[0];
+        float s1 = 0, s2 = 0;
+        for(j = 0; j < cols; ++j){
+            float d = x[j] - k;
+            s1 += d;
+            s2 += d*d;
+        }
+        float mean = s1/cols;
+        float var = s2/cols - mean*mean;
+        float rstd = 1.f/sqrtf((var > 0 ? var : 0) + eps);
+        mean += k;
+        if(gamma.data && beta.data){
+            for(j = 0; j < cols; ++j) y[j] = (x[j] - mean)*rstd*gamma.data[j] + beta.data[j];
+        } else if(gamma.data){
+            for(j = 0; j < cols; ++j) y[j] = (x[j] - mean)*rstd*gamma.data[j];
+        } else {
+            for(j = 0; j < cols; ++j) y[j] = (x[j] - mean)*rstd;
+            if(beta.data) for(j = 0; j < cols; ++j) y[j] += beta.data[j];
+        }
+    }
+    PROF_END(PROF_LAYERNORM, start, 0);
+    return r;
+}
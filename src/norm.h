@@ -0,0 +1,26 @@
+// Include guards and C++ compatibility
+#ifndef NORM_H
+#define NORM_H
+#include "tensor.h"
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Row-wise normalizations over the last axis, every other axis is a batch
+// of independent rows. Each is one fused two pass kernel, with rows spread
+// over threads. exp is simd_expf (see fastmath.h), so results are within a
+// few ulp of the libm versions.
+
+// Softmax keeps a running max and a running sum of exp(x - max), rescaling
+// the sum whenever the max grows, so no separate max pass is needed and
+// exp runs once per element
+tensor tensor_softmax(tensor t);
+tensor tensor_log_softmax(tensor t);
+// (x - mean)/sqrt(var + eps)*gamma + beta. gamma and beta have one entry
+// per column, pass a tensor with no data to skip either.
+tensor tensor_layernorm(tensor t, tensor gamma, tensor beta, float eps);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,75 @@
+#include <assert.h>
+#include <float.h>
+#include "pool.h"
+#include "prof.h"
+
+#define MIN(a,b) (((a)<(b))?(a):(b))
+
+size_t pool2d_output_size(size_t in, size_t size, size_t stride, size_t pad)
+{
+    assert(size > 0 && stride > 0 && pad < size);
+    assert(in + 2*pad >= size);
+    return (in + 2*pad - size)/stride + 1;
+}
+
+// Windows clipped to the image: [lo, hi) of output o along one axis
+static void pool2d_window_(size_t o, size_t n, size_t size, size_t stride, size_t pad,
+        size_t *lo, size_t *hi)
+{
+    size_t start = o*stride;
+    *lo = start > pad ? start - pad : 0;
+    *hi = MIN(start + size - pad, n);
+}
+
+void pool2d_band(const float *data, size_t h, size_t w, size_t y0, size_t rows,
+        pool_type type, size_t size, size_t stride, size_t pad,
+        size_t oy0, size_t oy1, float *out)
+{
+    size_t out_w = pool2d_output_size(w, size, stride, pad);
+    size_t oy, ox, y, x;
+    for(oy = oy0; oy < oy1; ++oy){
+        size_t ylo, yhi;
+        float *o = out + (oy - oy0)*out_w;
+        pool2d_window_(oy, h, size, stride, pad, &ylo, &yhi);
+        assert(ylo >= y0 && yhi <= y0 + rows);
+        for(ox = 0; ox < out_w; ++ox){
+            size_t xlo, xhi;
+            pool2d_window_(ox, w, size, stride, pad, &xlo, &xhi);
+            if(type == POOL_MAX){
+                float m = -FLT_MAX;
+                for(y = ylo; y < yhi; ++y){
+                    const float *row = data + (y - y0)*w;
+                    for(x = xlo; x < xhi; ++x) m = row[x] > m ? row[x] : m;
+                }
+                o[ox] = m;
+            } else {
+                float s = 0;
+                for(y = ylo; y < yhi; ++y){
+                    const float *row = data + (y - y0)*w;
+                    for(x = xlo; x < xhi; ++x) s += row[x];
+                }
+                o[ox] = s/((yhi - ylo)*(xhi - xlo));
+            }
+        }
+    }
+}
+
+tensor pool2d(tensor im, pool_type type, size_t size, size_t stride, size_t pad)
+{
+    assert(im.n == 3);
+    size_t c = im.size[0];
+    size_t h = im.size[1];
+    size_t w = im.size[2];
+    size_t out_h = pool2d_output_size(h, size, stride, pad);
+    size_t out_w = pool2d_output_size(w, size, stride, pad);
+    PROF_BEGIN(start);
+    tensor r = tensor_vmake(3, c, out_h, out_w);
+    size_t i;
+    #pragma omp parallel for schedule(static)
+    for(i = 0; i < c; ++i){
+        pool2d_band(im.data + i*h*w, h, w, 0, h, type, size, stride, pad,
+                0, out_h, r.data + i*out_h*out_w);
+    }
+    PROF_END(PROF_POOL2D, start, (double)c*out_h*out_w*size*size);
+    return r;
+}
@@ -0,0 +1,33 @@
+// Include guards and C++ compatibility
+#ifndef POOL_H
+#define POOL_H
+#include "tensor.h"
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// 2-D pooling of a (channels x h x w) image over size x size windows. The
+// output is (channels x (h + 2*pad - size)/stride + 1 x same for w). Taps
+// in the padding are skipped: max ignores them and avg divides by the
+// number of taps inside the image. pad must be less than size, so every
+// window holds at least one pixel.
+
+typedef enum {
+    POOL_MAX,
+    POOL_AVG
+} pool_type;
+
+tensor pool2d(tensor im, pool_type type, size_t size, size_t stride, size_t pad);
+size_t pool2d_output_size(size_t in, size_t size, size_t stride, size_t pad);
+
+// Pools output rows [oy0, oy1) of one h x w channel into out, a row-major
+// (oy1 - oy0) x out_w array. data holds channel rows [y0, y0 + rows), which
+// must include every in-image row those windows touch.
+void pool2d_band(const float *data, size_t h, size_t w, size_t y0, size_t rows,
+        pool_type type, size_t size, size_t stride, size_t pad,
+        size_t oy0, size_t oy1, float *out);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,270 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "prof.h"
+
+typedef struct prof_event {
+    prof_op op;
+    double start;
+    double end;
+} prof_event;
+
+// One block per thread, linked into a global list so dumps can merge them.
+// Blocks are never freed so counts from finished threads survive.
+typedef struct prof_block {
+    size_t id;
+    size_t calls[PROF_NOPS];
+    double time[PROF_NOPS];
+    double flops[PROF_NOPS];
+    size_t allocs;
+    size_t alloc_bytes;
+    prof_event *events;
+    size_t nevents;
+    size_t capevents;
+    struct prof_block *next;
+} prof_block;
+
+static const char *prof_names[PROF_NOPS] = {
+    "tensor_add",
+    "tensor_mul",
+    "tensor_axpy",
+    "tensor_scale",
+    "tensor_copy",
+    "tensor_mutable",
+    "matrix_multiply",
+    "matrix_transpose",
+    "matrix_invert",
+    "solve_system",
+    "im2col",
+    "conv2d",
+    "conv2d_stream",
+    "tensor_random",
+    "sparse_multiply",
+    "solve_cg",
+    "solve_gmres",
+    "conv2d_backward_input",
+    "conv2d_backward_filter",
+    "tensor_softmax",
+    "tensor_log_softmax",
+    "tensor_layernorm",
+    "tensor_unary",
+    "pool2d",
+    "conv2d_act_pool",
+    "matrix_multiply_ooc",
+    "matrix_gemv",
+    "matrix_batch_dot",
+};
+
+int prof_enabled = 0;
+static int prof_tracing = 0;
+static double prof_epoch = 0;
+static size_t prof_live = 0;
+static size_t prof_peak = 0;
+static prof_block *prof_blocks = 0;
+static size_t prof_nblocks = 0;
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread prof_block *prof_local = 0;
+static const char *prof_trace_path = 0;
+static int prof_exit_json = 0;
+
+double prof_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static prof_block *prof_block_get()
+{
+    if(!prof_local){
+        prof_block *b = calloc(1, sizeof(prof_block));
+        pthread_mutex_lock(&prof_lock);
+        b->id = prof_nblocks++;
+        b->next = prof_blocks;
+        prof_blocks = b;
+        pthread_mutex_unlock(&prof_lock);
+        prof_local = b;
+    }
+    return prof_local;
+}
+
+void prof_enable(int on)
+{
+    if(on && prof_epoch == 0) prof_epoch = prof_now();
+    prof_enabled = on;
+}
+
+void prof_trace(int on)
+{
+    if(on) prof_enable(1);
+    prof_tracing = on;
+}
+
+// Not safe to call while other threads are running instrumented ops
+void prof_reset()
+{
+    prof_block *b;
+    pthread_mutex_lock(&prof_lock);
+    for(b = prof_blocks; b; b = b->next){
+        memset(b->calls, 0, sizeof(b->calls));
+        memset(b->time, 0, sizeof(b->time));
+        memset(b->flops, 0, sizeof(b->flops));
+        b->allocs = 0;
+        b->alloc_bytes = 0;
+        b->nevents = 0;
+    }
+    prof_peak = prof_live;
+    prof_epoch = prof_now();
+    pthread_mutex_unlock(&prof_lock);
+}
+
+void prof_record(prof_op op, double start, double flops)
+{
+    // Profiling was switched on in the middle of this op
+    if(start == 0) return;
+    double end = prof_now();
+    prof_block *b = prof_block_get();
+    b->calls[op] += 1;
+    b->time[op] += end - start;
+    b->flops[op] += flops;
+    if(prof_tracing){
+        if(b->nevents == b->capevents){
+            b->capevents = b->capevents ? 2*b->capevents : 1024;
+            b->events = realloc(b->events, b->capevents*sizeof(prof_event));
+        }
+        prof_event e = {op, start, end};
+        b->events[b->nevents++] = e;
+    }
+}
+
+void prof_alloc(size_t bytes)
+{
+    prof_block *b = prof_block_get();
+    b->allocs += 1;
+    b->alloc_bytes += bytes;
+    size_t live = __atomic_add_fetch(&prof_live, bytes, __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&prof_peak, __ATOMIC_RELAXED);
+    while(live > peak && !__atomic_compare_exchange_n(&prof_peak, &peak, live,
+                1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+void prof_release(size_t bytes)
+{
+    // Only buffers that went through prof_alloc come back here, so this
+    // should never underflow; clamp inside the CAS anyway so a stray
+    // release cannot wrap prof_live around
+    size_t live = __atomic_load_n(&prof_live, __ATOMIC_RELAXED);
+    size_t next;
+    do {
+        next = bytes < live ? live - bytes : 0;
+    } while(!__atomic_compare_exchange_n(&prof_live, &live, next,
+                1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static prof_block prof_merge()
+{
+    prof_block m = {0};
+    prof_block *b;
+    size_t i;
+    pthread_mutex_lock(&prof_lock);
+    for(b = prof_blocks; b; b = b->next){
+        for(i = 0; i < PROF_NOPS; ++i){
+            m.calls[i] += b->calls[i];
+            m.time[i] += b->time[i];
+            m.flops[i] += b->flops[i];
+        }
+        m.allocs += b->allocs;
+        m.alloc_bytes += b->alloc_bytes;
+    }
+    m.id = prof_nblocks;
+    pthread_mutex_unlock(&prof_lock);
+    return m;
+}
+
+size_t prof_calls(prof_op op)
+{
+    return prof_merge().calls[op];
+}
+
+size_t prof_peak_bytes()
+{
+    return prof_peak;
+}
+
+void prof_dump(FILE *fp)
+{
+    prof_block m = prof_merge();
+    size_t i;
+    fprintf(fp, "%-20s %10s %12s %12s %10s\n", "op", "calls", "total ms", "mean us", "gflops");
+    for(i = 0; i < PROF_NOPS; ++i){
+        if(!m.calls[i]) continue;
+        fprintf(fp, "%-20s %10zu %12.3f %12.3f %10.3f\n", prof_names[i], m.calls[i],
+                m.time[i]*1e3, m.time[i]*1e6/m.calls[i],
+                m.time[i] > 0 ? m.flops[i]/m.time[i]/1e9 : 0);
+    }
+    fprintf(fp, "threads %zu, allocations %zu, allocated %.3f MB, peak live %.3f MB\n",
+            m.id, m.allocs, m.alloc_bytes/1e6, prof_peak/1e6);
+}
+
+void prof_dump_json(FILE *fp)
+{
+    prof_block m = prof_merge();
+    size_t i;
+    int first = 1;
+    fprintf(fp, "{\"ops\": {");
+    for(i = 0; i < PROF_NOPS; ++i){
+        if(!m.calls[i]) continue;
+        fprintf(fp, "%s\n  \"%s\": {\"calls\": %zu, \"time_s\": %.9g, \"flops\": %.17g}",
+                first ? "" : ",", prof_names[i], m.calls[i], m.time[i], m.flops[i]);
+        first = 0;
+    }
+    fprintf(fp, "},\n \"threads\": %zu, \"allocations\": %zu, \"allocated_bytes\": %zu, "
+            "\"peak_live_bytes\": %zu}\n", m.id, m.allocs, m.alloc_bytes, prof_peak);
+}
+
+int prof_dump_trace(const char *path)
+{
+    FILE *fp = fopen(path, "w");
+    if(!fp){
+        fprintf(stderr, "Couldn't open trace file %s\n", path);
+        return 0;
+    }
+    prof_block *b;
+    size_t i;
+    int first = 1;
+    fprintf(fp, "{\"traceEvents\": [");
+    pthread_mutex_lock(&prof_lock);
+    for(b = prof_blocks; b; b = b->next){
+        for(i = 0; i < b->nevents; ++i){
+            prof_event e = b->events[i];
+            fprintf(fp, "%s\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 0, \"tid\": %zu, "
+                    "\"ts\": %.3f, \"dur\": %.3f}", first ? "" : ",", prof_names[e.op], b->id,
+                    (e.start - prof_epoch)*1e6, (e.end - e.start)*1e6);
+            first = 0;
+        }
+    }
+    pthread_mutex_unlock(&prof_lock);
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+    return 1;
+}
+
+static void prof_exit()
+{
+    if(prof_exit_json) prof_dump_json(stderr);
+    else prof_dump(stderr);
+    if(prof_trace_path) prof_dump_trace(prof_trace_path);
+}
+
+__attribute__((constructor)) static void prof_init()
+{
+    const char *mode = getenv("TENSWORDS_PROF");
+    prof_trace_path = getenv("TENSWORDS_TRACE");
+    if(prof_trace_path && !*prof_trace_path) prof_trace_path = 0;
+    if(!(mode && *mode && strcmp(mode, "0")) && !prof_trace_path) return;
+    prof_exit_json = mode && !strcmp(mode, "json");
+    prof_enable(1);
+    if(prof_trace_path) prof_trace(1);
+    atexit(prof_exit);
+}
@@ -0,0 +1,70 @@
+// Include guards and C++ compatibility
+#ifndef PROF_H
+#define PROF_H
+#include <stdio.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Opt-in profiling of the library's hot paths. Turn it on with
+// prof_enable(1) or by running with TENSWORDS_PROF=1 (table on stderr at
+// exit) or TENSWORDS_PROF=json. TENSWORDS_TRACE=file.json also records a
+// timeline in Chrome trace format (chrome://tracing, Perfetto).
+// Counters live in thread-local blocks that are merged when dumped. Times
+// are inclusive, so conv2d also counts the im2col and GEMM it runs.
+// When disabled every hook is a single predictable branch.
+
+typedef enum {
+    PROF_ADD,
+    PROF_MUL,
+    PROF_AXPY,
+    PROF_SCALE,
+    PROF_COPY,
+    PROF_DETACH,
+    PROF_MATRIX_MULTIPLY,
+    PROF_TRANSPOSE,
+    PROF_INVERT,
+    PROF_SOLVE_SYSTEM,
+    PROF_IM2COL,
+    PROF_CONV2D,
+    PROF_CONV2D_STREAM,
+    PROF_RANDOM,
+    PROF_SPARSE_MULTIPLY,
+    PROF_SOLVE_CG,
+    PROF_SOLVE_GMRES,
+    PROF_CONV2D_BACKWARD_INPUT,
+    PROF_CONV2D_BACKWARD_FILTER,
+    PROF_SOFTMAX,
+    PROF_LOG_SOFTMAX,
+    PROF_LAYERNORM,
+    PROF_UNARY,
+    PROF_POOL2D,
+    PROF_CONV2D_ACT_POOL,
+    PROF_MATRIX_MULTIPLY_OOC,
+    PROF_GEMV,
+    PROF_BATCH_DOT,
+    PROF_NOPS
+} prof_op;
+
+extern int prof_enabled;
+
+void prof_enable(int on);
+void prof_trace(int on);
+void prof_reset();
+double prof_now();
+void prof_record(prof_op op, double start, double flops);
+void prof_alloc(size_t bytes);
+void prof_release(size_t bytes);
+size_t prof_calls(prof_op op);
+size_t prof_peak_bytes();
+void prof_dump(FILE *fp);
+void prof_dump_json(FILE *fp);
+int prof_dump_trace(const char *path);
+
+#define PROF_BEGIN(start) double start = prof_enabled ? prof_now() : 0
+#define PROF_END(op, start, flops) do { if(prof_enabled) prof_record(op, start, flops); } while (0)
+
+#ifdef __cplusplus
+}
+#endif
+#endif
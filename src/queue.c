@@ -0,0 +1,305 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "queue.h"
+#include "matrix.h"
+#include "conv.h"
+
+typedef struct task task;
+
+// Parameters of the built in ops, stored in the task itself. Their ctx
+// points here; a user op's ctx is passed through as given, 0 included.
+typedef struct task_params {
+    size_t stride;
+    size_t pad;
+    float alpha;
+} task_params;
+
+struct future {
+    size_t refs;            // Caller, the producing task and every reader
+    int done;               // Set last with release order, value is final then
+    tensor value;
+    queue *q;               // 0 for future_ready
+    task **waiters;         // Tasks blocked on this future, under q->lock
+    size_t nwaiters;
+};
+
+struct task {
+    queue_fn fn;
+    void *ctx;
+    task_params params;
+    future **inputs;
+    size_t ninputs;
+    size_t pending;         // Inputs not done yet
+    future *out;
+    task *next;
+};
+
+struct queue {
+    pthread_t *threads;
+    size_t nthreads;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;   // Signalled when a task becomes runnable
+    pthread_cond_t done;    // Broadcast when any task finishes
+    task *head;
+    task *tail;
+    size_t outstanding;
+    int stop;
+};
+
+static future *future_make(queue *q)
+{
+    future *f = calloc(1, sizeof(future));
+    f->refs = 1;
+    f->q = q;
+    return f;
+}
+
+future *future_ready(tensor t)
+{
+    future *f = future_make(0);
+    f->done = 1;
+    f->value = t;
+    return f;
+}
+
+static void future_retain(future *f)
+{
+    __atomic_add_fetch(&f->refs, 1, __ATOMIC_RELAXED);
+}
+
+void future_free(future *f)
+{
+    if(!f || __atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL)) return;
+    tensor_free(f->value);
+    free(f->waiters);
+    free(f);
+}
+
+// A done future never touches its queue again, so it stays valid after
+// queue_free. Only futures still pending wait on the queue's condvar, and
+// queue_free syncs before it tears that down.
+void future_wait(future *f)
+{
+    if(__atomic_load_n(&f->done, __ATOMIC_ACQUIRE)) return;
+    pthread_mutex_lock(&f->q->lock);
+    while(!f->done) pthread_cond_wait(&f->q->done, &f->q->lock);
+    pthread_mutex_unlock(&f->q->lock);
+}
+
+int future_done(future *f)
+{
+    return __atomic_load_n(&f->done, __ATOMIC_ACQUIRE);
+}
+
+tensor future_get(future *f)
+{
+    future_wait(f);
+    if(!f->value.buf){
+        tensor none = {0};
+        return none;
+    }
+    return tensor_retain(f->value);
+}
+
+// Called with q->lock held
+static void queue_push(queue *q, task *t)
+{
+    t->next = 0;
+    if(q->tail) q->tail->next = t;
+    else q->head = t;
+    q->tail = t;
+    pthread_cond_signal(&q->ready);
+}
+
+static void *queue_worker(void *arg)
+{
+    queue *q = arg;
+    size_t i;
+    while(1){
+        pthread_mutex_lock(&q->lock);
+        while(!q->head && !q->stop) pthread_cond_wait(&q->ready, &q->lock);
+        if(!q->head){
+            pthread_mutex_unlock(&q->lock);
+            return 0;
+        }
+        task *t = q->head;
+        q->head = t->next;
+        if(!q->head) q->tail = 0;
+        pthread_mutex_unlock(&q->lock);
+
+        // Inputs are done and immutable now, read them without the lock
+        tensor *inputs = calloc(t->ninputs ? t->ninputs : 1, sizeof(tensor));
+        for(i = 0; i < t->ninputs; ++i) inputs[i] = t->inputs[i]->value;
+        tensor value = t->fn(inputs, t->ctx);
+        free(inputs);
+
+        pthread_mutex_lock(&q->lock);
+        future *out = t->out;
+        out->value = value;
+        __atomic_store_n(&out->done, 1, __ATOMIC_RELEASE);
+        for(i = 0; i < out->nwaiters; ++i){
+            if(--out->waiters[i]->pending == 0) queue_push(q, out->waiters[i]);
+        }
+        free(out->waiters);
+        out->waiters = 0;
+        out->nwaiters = 0;
+        --q->outstanding;
+        pthread_cond_broadcast(&q->done);
+        pthread_mutex_unlock(&q->lock);
+
+        for(i = 0; i < t->ninputs; ++i) future_free(t->inputs[i]);
+        future_free(out);
+        free(t->inputs);
+        free(t);
+    }
+}
+
+queue *queue_make(size_t threads)
+{
+    queue *q = calloc(1, sizeof(queue));
+    size_t i;
+    if(!threads){
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = n > 0 ? n : 1;
+    }
+    pthread_mutex_init(&q->lock, 0);
+    pthread_cond_init(&q->ready, 0);
+    pthread_cond_init(&q->done, 0);
+    q->nthreads = threads;
+    q->threads = calloc(threads, sizeof(pthread_t));
+    for(i = 0; i < threads; ++i){
+        pthread_create(&q->threads[i], 0, queue_worker, q);
+    }
+    return q;
+}
+
+void queue_sync(queue *q)
+{
+    pthread_mutex_lock(&q->lock);
+    while(q->outstanding) pthread_cond_wait(&q->done, &q->lock);
+    pthread_mutex_unlock(&q->lock);
+}
+
+void queue_free(queue *q)
+{
+    size_t i;
+    queue_sync(q);
+    pthread_mutex_lock(&q->lock);
+    q->stop = 1;
+    pthread_cond_broadcast(&q->ready);
+    pthread_mutex_unlock(&q->lock);
+    for(i = 0; i < q->nthreads; ++i){
+        pthread_join(q->threads[i], 0);
+    }
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->ready);
+    pthread_cond_destroy(&q->done);
+    free(q->threads);
+    free(q);
+}
+
+// params is 0 for user ops, which get ctx, or the built in op's parameters,
+// copied into the task and handed to fn in place of ctx
+static future *queue_submit_(queue *q, queue_fn fn, void *ctx, const task_params *params,
+        future **inputs, size_t ninputs)
+{
+    size_t i;
+    task *t = calloc(1, sizeof(task));
+    t->fn = fn;
+    t->ctx = ctx;
+    if(params){
+        t->params = *params;
+        t->ctx = &t->params;
+    }
+    t->ninputs = ninputs;
+    t->inputs = calloc(ninputs ? ninputs : 1, sizeof(future *));
+    t->out = future_make(q);
+    future_retain(t->out);
+
+    pthread_mutex_lock(&q->lock);
+    for(i = 0; i < ninputs; ++i){
+        future *in = inputs[i];
+        assert(in->done || in->q == q);
+        future_retain(in);
+        t->inputs[i] = in;
+        if(!in->done){
+            in->waiters = realloc(in->waiters, (in->nwaiters + 1)*sizeof(task *));
+            in->waiters[in->nwaiters++] = t;
+            ++t->pending;
+        }
+    }
+    ++q->outstanding;
+    if(!t->pending) queue_push(q, t);
+    future *out = t->out;
+    pthread_mutex_unlock(&q->lock);
+    return out;
+}
+
+future *queue_submit(queue *q, queue_fn fn, void *ctx, future **inputs, size_t ninputs)
+{
+    return queue_submit_(q, fn, ctx, 0, inputs, ninputs);
+}
+
+static tensor queue_conv2d_(const tensor *in, void *ctx)
+{
+    task_params *p = ctx;
+    return conv2d(in[0], in[1], p->stride, p->pad);
+}
+
+static tensor queue_matrix_multiply_(const tensor *in, void *ctx)
+{
+    return matrix_multiply(in[0], in[1]);
+}
+
+static tensor queue_add_(const tensor *in, void *ctx)
+{
+    return tensor_add(in[0], in[1]);
+}
+
+static tensor queue_mul_(const tensor *in, void *ctx)
+{
+    return tensor_mul(in[0], in[1]);
+}
+
+static tensor queue_axpy_(const tensor *in, void *ctx)
+{
+    task_params *p = ctx;
+    return tensor_axpy(p->alpha, in[0], in[1]);
+}
+
+future *queue_conv2d(queue *q, future *im, future *filters, size_t stride, size_t pad)
+{
+    future *in[2] = {im, filters};
+    task_params p = {stride, pad, 0};
+    return queue_submit_(q, queue_conv2d_, 0, &p, in, 2);
+}
+
+future *queue_matrix_multiply(queue *q, future *a, future *b)
+{
+    future *in[2] = {a, b};
+    task_params p = {0};
+    return queue_submit_(q, queue_matrix_multiply_, 0, &p, in, 2);
+}
+
+future *queue_add(queue *q, future *a, future *b)
+{
+    future *in[2] = {a, b};
+    task_params p = {0};
+    return queue_submit_(q, queue_add_, 0, &p, in, 2);
+}
+
+future *queue_mul(queue *q, future *a, future *b)
+{
+    future *in[2] = {a, b};
+    task_params p = {0};
+    return queue_submit_(q, queue_mul_, 0, &p, in, 2);
+}
+
+future *queue_axpy(queue *q, float a, future *x, future *y)
+{
+    future *in[2] = {x, y};
+    task_params p = {0, 0, a};
+    return queue_submit_(q, queue_axpy_, 0, &p, in, 2);
+}
@@ -0,0 +1,48 @@
+// Include guards and C++ compatibility
+#ifndef QUEUE_H
+#define QUEUE_H
+#include "tensor.h"
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Asynchronous op queue. Ops are submitted with futures for their inputs
+// and return a future for their output right away. A pool of worker threads
+// runs every op as soon as all of its inputs are done, so independent work
+// (im2col for frame N+1 while the GEMM of frame N runs) overlaps and a
+// multi-stage pipeline runs at the rate of its slowest stage.
+//
+// Futures are reference counted. The caller owns the future a submit
+// returns and drops it with future_free, which is safe while ops still
+// depend on it. future_get blocks and returns a new handle on the result
+// (see tensor_retain) that the caller frees. Since queue_free syncs first,
+// every future is done afterwards and can still be read and freed.
+
+typedef struct queue queue;
+typedef struct future future;
+
+// Inputs are read only and stay owned by their futures, the returned
+// tensor becomes the value of the op's future
+typedef tensor (*queue_fn)(const tensor *inputs, void *ctx);
+
+queue *queue_make(size_t threads);  // 0 threads means one per CPU
+void queue_sync(queue *q);          // Waits until every submitted op is done
+void queue_free(queue *q);          // Syncs, then stops the workers
+
+future *future_ready(tensor t);     // Already done future holding t, takes ownership
+tensor future_get(future *f);
+void future_wait(future *f);
+int future_done(future *f);
+void future_free(future *f);
+
+future *queue_submit(queue *q, queue_fn fn, void *ctx, future **inputs, size_t ninputs);
+future *queue_conv2d(queue *q, future *im, future *filters, size_t stride, size_t pad);
+future *queue_matrix_multiply(queue *q, future *a, future *b);
+future *queue_add(queue *q, future *a, future *b);
+future *queue_mul(queue *q, future *a, future *b);
+future *queue_axpy(queue *q, float a, future *x, future *y);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,160 @@
+#include <math.h>
+#include <stdlib.h>
+#include "random.h"
+#include "prof.h"
+
+#define MIN(a,b) (((a)<(b))?(a):(b))
+
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+
+// Philox blocks per task, each block gives 4 floats
+#define RANDOM_CHUNK 1024
+
+#define RANDOM_UNIFORM 0
+#define RANDOM_NORMAL 1
+#define RANDOM_TRUNCATED 2
+
+static uint64_t random_state = 0x853c49e6748fea9bULL;
+
+static inline void philox4x32_(uint32_t c0, uint32_t c1, uint32_t c2, uint32_t c3,
+        uint32_t k0, uint32_t k1, uint32_t *out)
+{
+    int r;
+    for(r = 0; r < 10; ++r){
+        uint64_t p0 = (uint64_t)PHILOX_M0 * c0;
+        uint64_t p1 = (uint64_t)PHILOX_M1 * c2;
+        uint32_t n0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+        uint32_t n2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+        c0 = n0;
+        c1 = (uint32_t)p1;
+        c2 = n2;
+        c3 = (uint32_t)p0;
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
+    }
+    out[0] = c0;
+    out[1] = c1;
+    out[2] = c2;
+    out[3] = c3;
+}
+
+void philox4x32(const uint32_t ctr[4], const uint32_t key[2], uint32_t out[4])
+{
+    philox4x32_(ctr[0], ctr[1], ctr[2], ctr[3], key[0], key[1], out);
+}
+
+// 24 random bits to [0, 1)
+static inline float random_unit_(uint32_t u)
+{
+    return (u >> 8) * (1.f/16777216.f);
+}
+
+// Box-Muller on each pair of words, 4 words give 4 normals
+static inline void random_normal4_(const uint32_t *u, float *z)
+{
+    int i;
+    for(i = 0; i < 4; i += 2){
+        float u0 = ((u[i] >> 8) + 1) * (1.f/16777216.f);
+        float theta = 6.283185307179586f * random_unit_(u[i+1]);
+        float r = sqrtf(-2.f*logf(u0));
+        z[i] = r*cosf(theta);
+        z[i+1] = r*sinf(theta);
+    }
+}
+
+static void random_fill_(tensor *t, uint64_t seed, int dist, float a, float b)
+{
+    float *data = tensor_mutable(t);
+    size_t len = tensor_len(*t);
+    size_t blocks = (len + 3)/4;
+    uint32_t k0 = (uint32_t)seed;
+    uint32_t k1 = (uint32_t)(seed >> 32);
+    size_t c;
+    PROF_BEGIN(start);
+    #pragma omp parallel for schedule(static)
+    for(c = 0; c < blocks; c += RANDOM_CHUNK){
+        size_t blk;
+        size_t end = MIN(c + RANDOM_CHUNK, blocks);
+        for(blk = c; blk < end; ++blk){
+            uint32_t u[4];
+            float v[4];
+            size_t j;
+            philox4x32_((uint32_t)blk, (uint32_t)(blk >> 32), 0, 0, k0, k1, u);
+            if(dist == RANDOM_UNIFORM){
+                for(j = 0; j < 4; ++j) v[j] = a + (b - a)*random_unit_(u[j]);
+            } else {
+                random_normal4_(u, v);
+                // Redraw out of range lanes from fresh counters. Each lane
+                // counts its own rounds r in the third counter word and puts
+                // its index in the fourth, so a lane's value depends only on
+                // (seed, element) and not on how often its neighbours redrew.
+                for(j = 0; j < 4 && dist == RANDOM_TRUNCATED; ++j){
+                    uint32_t r = 1;
+                    while(fabsf(v[j]) > 2.f){
+                        float z[4];
+                        philox4x32_((uint32_t)blk, (uint32_t)(blk >> 32), r++, (uint32_t)j, k0, k1, u);
+                        random_normal4_(u, z);
+                        v[j] = z[j];
+                    }
+                }
+                for(j = 0; j < 4; ++j) v[j] = a + b*v[j];
+            }
+            size_t n = MIN(4, len - 4*blk);
+            for(j = 0; j < n; ++j) data[4*blk + j] = v[j];
+        }
+    }
+    PROF_END(PROF_RANDOM, start, 0);
+}
+
+void tensor_fill_uniform(tensor *t, uint64_t seed, float lo, float hi)
+{
+    random_fill_(t, seed, RANDOM_UNIFORM, lo, hi);
+}
+
+void tensor_fill_normal(tensor *t, uint64_t seed, float mean, float std)
+{
+    random_fill_(t, seed, RANDOM_NORMAL, mean, std);
+}
+
+void tensor_fill_truncated_normal(tensor *t, uint64_t seed, float mean, float std)
+{
+    random_fill_(t, seed, RANDOM_TRUNCATED, mean, std);
+}
+
+tensor tensor_random_uniform(uint64_t seed, float lo, float hi, const size_t n, const size_t *size)
+{
+    tensor t = tensor_make(n, size);
+    tensor_fill_uniform(&t, seed, lo, hi);
+    return t;
+}
+
+tensor tensor_random_normal(uint64_t seed, float mean, float std, const size_t n, const size_t *size)
+{
+    tensor t = tensor_make(n, size);
+    tensor_fill_normal(&t, seed, mean, std);
+    return t;
+}
+
+tensor tensor_random_truncated_normal(uint64_t seed, float mean, float std, const size_t n, const size_t *size)
+{
+    tensor t = tensor_make(n, size);
+    tensor_fill_truncated_normal(&t, seed, mean, std);
+    return t;
+}
+
+void tensor_random_seed(uint64_t seed)
+{
+    __atomic_store_n(&random_state, seed, __ATOMIC_RELAXED);
+}
+
+// splitmix64 so consecutive tensors get unrelated keys
+uint64_t tensor_random_next_seed()
+{
+    uint64_t z = __atomic_add_fetch(&random_state, 0x9e3779b97f4a7c15ULL, __ATOMIC_RELAXED);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
@@ -0,0 +1,34 @@
+// Include guards and C++ compatibility
+#ifndef RANDOM_H
+#define RANDOM_H
+#include <stdint.h>
+#include "tensor.h"
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Counter-based random numbers (Philox4x32-10). Element i of a tensor is a
+// pure function of (seed, i), so fills are reproducible and give the same
+// output for any number of threads. Fills only run in parallel in builds
+// with OPENMP=1, which is off by default. Fills write through
+// tensor_mutable, so a shared buffer is copied first.
+
+void philox4x32(const uint32_t ctr[4], const uint32_t key[2], uint32_t out[4]);
+
+void tensor_fill_uniform(tensor *t, uint64_t seed, float lo, float hi);
+void tensor_fill_normal(tensor *t, uint64_t seed, float mean, float std);
+// Normal resampled until it lands within two standard deviations of the mean
+void tensor_fill_truncated_normal(tensor *t, uint64_t seed, float mean, float std);
+
+tensor tensor_random_uniform(uint64_t seed, float lo, float hi, const size_t n, const size_t *size);
+tensor tensor_random_normal(uint64_t seed, float mean, float std, const size_t n, const size_t *size);
+tensor tensor_random_truncated_normal(uint64_t seed, float mean, float std, const size_t n, const size_t *size);
+
+// Seed for the sequence of tensors made by tensor_random
+void tensor_random_seed(uint64_t seed);
+uint64_t tensor_random_next_seed();
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,201 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <math.h>
+#include "sparse.h"
+#include "conv.h"
+#include "prof.h"
+
+csr csr_from_tensor(tensor t, float threshold)
+{
+    assert(t.n >= 2);
+    csr a = {0};
+    size_t i, j;
+    a.rows = t.size[0];
+    a.cols = tensor_len(t) / a.rows;
+    a.row_ptr = calloc(a.rows + 1, sizeof(size_t));
+    for(i = 0; i < a.rows; ++i){
+        for(j = 0; j < a.cols; ++j){
+            if(fabsf(t.data[i*a.cols + j]) > threshold) ++a.nnz;
+        }
+    }
+    a.col_idx = calloc(a.nnz, sizeof(size_t));
+    a.vals = calloc(a.nnz, sizeof(float));
+    size_t k = 0;
+    for(i = 0; i < a.rows; ++i){
+        for(j = 0; j < a.cols; ++j){
+            float v = t.data[i*a.cols + j];
+            if(fabsf(v) > threshold){
+                a.col_idx[k] = j;
+                a.vals[k] = v;
+                ++k;
+            }
+        }
+        a.row_ptr[i+1] = k;
+    }
+    return a;
+}
+
+tensor csr_to_tensor(csr a)
+{
+    tensor t = tensor_vmake(2, a.rows, a.cols);
+    size_t i, k;
+    for(i = 0; i < a.rows; ++i){
+        for(k = a.row_ptr[i]; k < a.row_ptr[i+1]; ++k){
+            t.data[i*a.cols + a.col_idx[k]] = a.vals[k];
+        }
+    }
+    return t;
+}
+
+void csr_free(csr a)
+{
+    free(a.row_ptr);
+    free(a.col_idx);
+    free(a.vals);
+}
+
+// Each nonzero scales one row of b into the output row, so the inner loop
+// runs over b's columns and rows of the output are independent.
+tensor csr_matrix_multiply(csr a, tensor b)
+{
+    assert(b.n == 2);
+    assert(a.cols == b.size[0]);
+    size_t N = b.size[1];
+    size_t i;
+    PROF_BEGIN(start);
+    tensor t = tensor_vmake(2, a.rows, N);
+    #pragma omp parallel for schedule(dynamic, 16)
+    for(i = 0; i < a.rows; ++i){
+        size_t j, k;
+        float *trow = t.data + i*N;
+        for(k = a.row_ptr[i]; k < a.row_ptr[i+1]; ++k){
+            float v = a.vals[k];
+            const float *brow = b.data + a.col_idx[k]*N;
+            for(j = 0; j < N; ++j){
+                trow[j] += v*brow[j];
+            }
+        }
+    }
+    PROF_END(PROF_SPARSE_MULTIPLY, start, 2.0*a.nnz*N);
+    return t;
+}
+
+void matvec_csr(void *ctx, const float *x, float *y)
+{
+    csr *a = ctx;
+    size_t i;
+    #pragma omp parallel for schedule(static)
+    for(i = 0; i < a->rows; ++i){
+        size_t k;
+        float sum = 0;
+        for(k = a->row_ptr[i]; k < a->row_ptr[i+1]; ++k){
+            sum += a->vals[k]*x[a->col_idx[k]];
+        }
+        y[i] = sum;
+    }
+}
+
+float *csr_diagonal(csr a)
+{
+    assert(a.rows == a.cols);
+    float *diag = calloc(a.rows, sizeof(float));
+    size_t i, k;
+    for(i = 0; i < a.rows; ++i){
+        for(k = a.row_ptr[i]; k < a.row_ptr[i+1]; ++k){
+            if(a.col_idx[k] == i) diag[i] = a.vals[k];
+        }
+    }
+    return diag;
+}
+
+bcsr bcsr_from_tensor(tensor t, size_t br, size_t bc, float threshold)
+{
+    assert(t.n >= 2);
+    assert(br > 0 && bc > 0);
+    bcsr a = {0};
+    size_t bi, bj, i, j;
+    a.rows = t.size[0];
+    a.cols = tensor_len(t) / a.rows;
+    assert(a.rows % br == 0 && a.cols % bc == 0);
+    a.br = br;
+    a.bc = bc;
+    size_t brows = a.rows / br;
+    size_t bcols = a.cols / bc;
+    a.row_ptr = calloc(brows + 1, sizeof(size_t));
+    a.col_idx = calloc(brows*bcols, sizeof(size_t));
+    a.vals = calloc(a.rows*a.cols, sizeof(float));
+    for(bi = 0; bi < brows; ++bi){
+        for(bj = 0; bj < bcols; ++bj){
+            int keep = 0;
+            for(i = 0; i < br && !keep; ++i){
+                for(j = 0; j < bc; ++j){
+                    if(fabsf(t.data[(bi*br + i)*a.cols + bj*bc + j]) > threshold) keep = 1;
+                }
+            }
+            if(!keep) continue;
+            float *block = a.vals + a.nblocks*br*bc;
+            for(i = 0; i < br; ++i){
+                for(j = 0; j < bc; ++j){
+                    block[i*bc + j] = t.data[(bi*br + i)*a.cols + bj*bc + j];
+                }
+            }
+            a.col_idx[a.nblocks++] = bj;
+        }
+        a.row_ptr[bi+1] = a.nblocks;
+    }
+    a.col_idx = realloc(a.col_idx, (a.nblocks ? a.nblocks : 1)*sizeof(size_t));
+    a.vals = realloc(a.vals, (a.nblocks ? a.nblocks : 1)*br*bc*sizeof(float));
+    return a;
+}
+
+void bcsr_free(bcsr a)
+{
+    free(a.row_ptr);
+    free(a.col_idx);
+    free(a.vals);
+}
+
+tensor bcsr_matrix_multiply(bcsr a, tensor b)
+{
+    assert(b.n == 2);
+    assert(a.cols == b.size[0]);
+    size_t N = b.size[1];
+    size_t brows = a.rows / a.br;
+    size_t bi;
+    PROF_BEGIN(start);
+    tensor t = tensor_vmake(2, a.rows, N);
+    #pragma omp parallel for schedule(dynamic, 4)
+    for(bi = 0; bi < brows; ++bi){
+        size_t i, j, k, c;
+        for(k = a.row_ptr[bi]; k < a.row_ptr[bi+1]; ++k){
+            const float *block = a.vals + k*a.br*a.bc;
+            const float *bpanel = b.data + a.col_idx[k]*a.bc*N;
+            for(i = 0; i < a.br; ++i){
+                float *trow = t.data + (bi*a.br + i)*N;
+                for(c = 0; c < a.bc; ++c){
+                    float v = block[i*a.bc + c];
+                    const float *brow = bpanel + c*N;
+                    for(j = 0; j < N; ++j){
+                        trow[j] += v*brow[j];
+                    }
+                }
+            }
+        }
+    }
+    PROF_END(PROF_SPARSE_MULTIPLY, start, 2.0*a.nblocks*a.br*a.bc*N);
+    return t;
+}
+
+tensor conv2d_sparse(tensor im, csr filters, size_t f_h, size_t f_w, size_t stride, size_t pad)
+{
+    assert(im.n == 3);
+    assert(filters.cols == im.size[0]*f_h*f_w); // Filters and image have same # channels
+    size_t res_c = filters.rows;
+    size_t res_h = (im.size[1] + 2*pad - f_h)/stride + 1;
+    size_t res_w = (im.size[2] + 2*pad - f_w)/stride + 1;
+
+    tensor col = im2col(im, f_h, f_w, stride, pad);
+    tensor res = csr_matrix_multiply(filters, col);
+    tensor_free(col);
+    return conv2d_output_(res, res_c, res_h, res_w);
+}
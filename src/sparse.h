@@ -0,0 +1,53 @@
+// Include guards and C++ compatibility
+#ifndef SPARSE_H
+#define SPARSE_H
+#include "tensor.h"
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Compressed sparse row matrix
+typedef struct csr {
+    size_t rows;
+    size_t cols;
+    size_t nnz;
+    size_t *row_ptr;    // rows + 1 offsets into col_idx and vals
+    size_t *col_idx;
+    float *vals;
+} csr;
+
+// Blocked CSR, nonzeros stored as dense br x bc blocks
+typedef struct bcsr {
+    size_t rows;
+    size_t cols;
+    size_t br;
+    size_t bc;
+    size_t nblocks;
+    size_t *row_ptr;    // rows/br + 1 offsets, in blocks
+    size_t *col_idx;    // block column of each block
+    float *vals;        // nblocks row-major br x bc blocks
+} bcsr;
+
+// Tensors with more than 2 dimensions are flattened to size[0] x rest,
+// so 4-D conv filters convert directly. Keeps entries with |v| > threshold.
+csr csr_from_tensor(tensor t, float threshold);
+tensor csr_to_tensor(csr a);
+void csr_free(csr a);
+tensor csr_matrix_multiply(csr a, tensor b);
+// y = A x as a matvec_fn for the Krylov solvers, ctx is a csr *
+void matvec_csr(void *ctx, const float *x, float *y);
+// Diagonal of a square matrix, for Jacobi preconditioning
+float *csr_diagonal(csr a);
+
+// Keeps every block holding at least one entry with |v| > threshold
+bcsr bcsr_from_tensor(tensor t, size_t br, size_t bc, float threshold);
+void bcsr_free(bcsr a);
+tensor bcsr_matrix_multiply(bcsr a, tensor b);
+
+// conv2d with pruned filters, filters is the csr of the 4-D filter tensor
+tensor conv2d_sparse(tensor im, csr filters, size_t f_h, size_t f_w, size_t stride, size_t pad);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
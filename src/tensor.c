@@ -4,11 +4,42 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "tensor.h"
+#include "prof.h"
+#include "random.h"
 
 #define MIN(a,b) (((a)<(b))?(a):(b))
 #define MAX(a,b) (((a)>(b))?(a):(b))
 
+tensor_buffer *tensor_buffer_make(size_t len)
+{
+    tensor_buffer *buf = calloc(1, sizeof(tensor_buffer));
+    buf->refs = 1;
+    buf->len = len;
+    buf->data = calloc(len, sizeof(float));
+    if(prof_enabled){
+        prof_alloc(len*sizeof(float));
+        buf->counted = 1;
+    }
+    return buf;
+}
+
+void tensor_buffer_release(tensor_buffer *buf)
+{
+    if(__atomic_sub_fetch(&buf->refs, 1, __ATOMIC_ACQ_REL)) return;
+    if(buf->release){
+        buf->release(buf);
+    } else {
+        if(buf->counted) prof_release(buf->len*sizeof(float));
+        free(buf->data);
+    }
+    free(buf);
+}
+
 tensor tensor_make(const size_t n, const size_t *size)
 {
     tensor t = {0};
@@ -18,30 +49,110 @@ tensor tensor_make(const size_t n, const size_t *size)
     for(i = 0; i < n; ++i){
         t.size[i] = size[i];
     }
-    size_t len = tensor_len(t);
-    t.data = calloc(len, sizeof(float));
+    t.buf = tensor_buffer_make(tensor_len(t));
+    t.data = t.buf->data;
+    return t;
+}
+
+static void tensor_munmap_(tensor_buffer *buf)
+{
+    munmap(buf->data, buf->len*sizeof(float));
+}
+
+// Mapped buffers are backed by the file, not the heap, so the profiler's
+// allocation counters leave them out
+tensor tensor_mmap(const char *path, const size_t n, const size_t *size, int create)
+{
+    tensor t = {0};
+    size_t i;
+    size_t len = 1;
+    for(i = 0; i < n; ++i) len *= size[i];
+    size_t bytes = len*sizeof(float);
+    struct stat st;
+    int fd = create ? open(path, O_RDWR | O_CREAT | O_TRUNC, 0644) : open(path, O_RDONLY);
+    if(fd < 0) return t;
+    if(create ? ftruncate(fd, bytes) != 0 : fstat(fd, &st) != 0 || (size_t)st.st_size < bytes){
+        close(fd);
+        return t;
+    }
+    void *p = mmap(0, bytes, PROT_READ | PROT_WRITE, create ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(p == MAP_FAILED) return t;
+
+    t.n = n;
+    t.size = calloc(n, sizeof(size_t));
+    memcpy(t.size, size, n*sizeof(size_t));
+    t.buf = calloc(1, sizeof(tensor_buffer));
+    t.buf->refs = 1;
+    t.buf->len = len;
+    t.buf->data = p;
+    t.buf->release = tensor_munmap_;
+    t.data = p;
     return t;
 }
 
+// New handle on the same buffer
+tensor tensor_retain(tensor t)
+{
+    assert(t.buf);
+    tensor r = t;
+    r.size = calloc(t.n, sizeof(size_t));
+    memcpy(r.size, t.size, t.n*sizeof(size_t));
+    __atomic_add_fetch(&t.buf->refs, 1, __ATOMIC_RELAXED);
+    return r;
+}
+
+void tensor_release(tensor t)
+{
+    tensor_free(t);
+}
+
+int tensor_shared(tensor t)
+{
+    return t.buf && __atomic_load_n(&t.buf->refs, __ATOMIC_ACQUIRE) > 1;
+}
+
+// Gives this handle its own buffer if others share it, call before writing
+float *tensor_mutable(tensor *t)
+{
+    if(!tensor_shared(*t)) return t->data;
+    PROF_BEGIN(start);
+    size_t len = tensor_len(*t);
+    tensor_buffer *buf = tensor_buffer_make(len);
+    memcpy(buf->data, t->data, len*sizeof(float));
+    tensor_buffer_release(t->buf);
+    t->buf = buf;
+    t->data = buf->data;
+    PROF_END(PROF_DETACH, start, 0);
+    return t->data;
+}
+
+// Copy on write: shares the buffer until one side calls tensor_mutable.
+// Views without a buffer are copied right away.
 tensor tensor_copy(tensor t)
 {
-    tensor c = tensor_make(t.n, t.size);
-    size_t i = 0;
-    size_t len = tensor_len(t);
-    for(i = 0; i < len; ++i){
-        c.data[i] = t.data[i];
+    PROF_BEGIN(start);
+    tensor c;
+    if(t.buf){
+        c = tensor_retain(t);
+    } else {
+        c = tensor_make(t.n, t.size);
+        memcpy(c.data, t.data, tensor_len(t)*sizeof(float));
     }
+    PROF_END(PROF_COPY, start, 0);
     return c;
 }
 
 tensor tensor_scale(tensor t, float s)
 {
-    tensor c = tensor_copy(t);
+    PROF_BEGIN(start);
+    tensor c = tensor_make(t.n, t.size);
     size_t i = 0;
     size_t len = tensor_len(c);
     for(i = 0; i < len; ++i){
-        c.data[i] *= s;
+        c.data[i] = t.data[i]*s;
     }
+    PROF_END(PROF_SCALE, start, len);
     return c;
 }
 
@@ -62,11 +173,7 @@ tensor tensor_vmake(const size_t n, ...)
 tensor tensor_random(const float s, const size_t n, const size_t *size)
 {
     tensor t = tensor_make(n, size);
-    size_t len = tensor_len(t);
-    size_t i;
-    for(i = 0; i < len; ++i){
-        t.data[i] = 2*s*((float)rand()/RAND_MAX) - s;
-    }
+    tensor_fill_uniform(&t, tensor_random_next_seed(), -s, s);
     return t;
 }
 
@@ -84,26 +191,15 @@ tensor tensor_get_(const tensor t, const size_t e)
 tensor tensor_get(const tensor t, const size_t e)
 {
     assert (e >= 0 && e < t.size[0]);
-    tensor a = {0};
 
     if(t.n == 1){
-        a.n = 1;
-        a.size = malloc(sizeof(size_t));
-        a.size[0] = 1;
-        a.data = malloc(sizeof(float));
+        tensor a = tensor_vmake(1, 1);
         a.data[0] = t.data[e];
         return a;
     }
 
-    a.n = t.n - 1;
-    a.size = calloc(a.n, sizeof(size_t));
-    size_t i;
-    size_t len = 1;
-    for(i = 0; i < a.n; ++i){
-        a.size[i] = t.size[i+1];
-        len *= a.size[i];
-    }
-    a.data = calloc(len, sizeof(float));
+    tensor a = tensor_make(t.n - 1, t.size + 1);
+    size_t len = tensor_len(a);
     memcpy(a.data, t.data + len*e, len*sizeof(float));
     return a;
 }
@@ -121,7 +217,8 @@ size_t tensor_len(const tensor t)
 void tensor_free(tensor t)
 {
     free(t.size);
-    free(t.data);
+    if(t.buf) tensor_buffer_release(t.buf);
+    else free(t.data);
 }
 
 void tensor_print(tensor t)
@@ -255,9 +352,11 @@ tensor tensor_binary_op(tensor a, tensor b, float op (float, float))
 
 tensor tensor_axpy(float a, tensor x, tensor y)
 {
+    PROF_BEGIN(start);
     tensor t = tensor_broadcast(x, y);
     if (t.data == 0) return t;
     tensor_axpy_(a, x, y, t);
+    PROF_END(PROF_AXPY, start, 2.0*tensor_len(t));
     return t;
 }
 
@@ -268,7 +367,10 @@ float tensor_add_op_(float a, float b)
 
 tensor tensor_add(tensor a, tensor b)
 {
-    return tensor_binary_op(a, b, tensor_add_op_);
+    PROF_BEGIN(start);
+    tensor t = tensor_binary_op(a, b, tensor_add_op_);
+    PROF_END(PROF_ADD, start, tensor_len(t));
+    return t;
 }
 
 tensor tensor_sub(tensor a, tensor b)
@@ -283,6 +385,9 @@ float tensor_mul_op_(float a, float b)
 
 tensor tensor_mul(tensor a, tensor b)
 {
-    return tensor_binary_op(a, b, tensor_mul_op_);
+    PROF_BEGIN(start);
+    tensor t = tensor_binary_op(a, b, tensor_mul_op_);
+    PROF_END(PROF_MUL, start, tensor_len(t));
+    return t;
 }
 
@@ -8,16 +8,47 @@ extern "C" {
 
 
 
+// Reference counted storage shared by tensor handles. data is calloc'd
+// unless release is set, in which case release frees it when the last
+// handle goes away (munmap for tensor_mmap). counted is set when the
+// allocation went into the profiler's live bytes, so it comes back out on
+// release even if profiling was switched off in between.
+typedef struct tensor_buffer {
+    size_t refs;
+    size_t len;
+    float *data;
+    int counted;
+    void (*release)(struct tensor_buffer *buf);
+} tensor_buffer;
+
+// Every handle owns its size array. Handles made by the library share data
+// through buf, which is 0 for views into memory owned by someone else.
+// tensor_copy shares the buffer and costs O(1); a handle that is about to
+// write into data must call tensor_mutable first, which copies the buffer
+// if any other handle still refers to it. Refcounts are atomic, so handles
+// to the same buffer can live on different threads, but a single handle
+// must not be used by two threads at once while it is written.
 typedef struct tensor {
     size_t n;
     size_t *size;
     float *data;
+    tensor_buffer *buf;
 } tensor;
 
 tensor tensor_make(const size_t n, const size_t *size);
 tensor tensor_vmake(const size_t n, ...);
 tensor tensor_random(const float s, const size_t n, const size_t *size);
+// Maps a file of raw row-major floats as a tensor, so it can be larger
+// than RAM and the kernel pages it in and out. With create the file is
+// made or truncated to the tensor's size, zero filled, and writes go to the
+// file. Otherwise the file must hold at least that many floats and is
+// mapped privately: writes stay in memory. Returns data 0 on error.
+tensor tensor_mmap(const char *path, const size_t n, const size_t *size, int create);
 void   tensor_free(tensor t);
+tensor tensor_retain(tensor t);
+void   tensor_release(tensor t);
+int    tensor_shared(tensor t);
+float *tensor_mutable(tensor *t);
 tensor tensor_get(const tensor t, const size_t e);
 size_t    tensor_len(const tensor t);
 
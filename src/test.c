@@ -1,29 +1,27 @@
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <math.h>
-#include <time.h>
-#include <sys/time.h>
+#include <float.h>
 #include "test.h"
 #include "tensor.h"
 #include "matrix.h"
 #include "conv.h"
+#include "prof.h"
+#include "tune.h"
+#include "random.h"
+#include "sparse.h"
+#include "krylov.h"
+#include "queue.h"
+#include "fft.h"
+#include "norm.h"
+#include "fastmath.h"
+#include "unary.h"
+#include "pool.h"
 
 int tests_total = 0;
 int tests_fail = 0;
 
-double gflops(double ops, double time)
-{
-    return ops / time / pow(10., 9);
-}
-
-double currtime()
-{
-    struct timeval time;
-    if (gettimeofday(&time,NULL)){
-        return 0;
-    }
-    return (double)time.tv_sec + (double)time.tv_usec * .000001;
-}
-
 int within_eps(float a, float b)
 {
     return fabs(a-b) < EPS;
@@ -253,140 +251,19 @@ void test_tensor()
         TEST(same_tensor(a023, t2));
         TEST(same_tensor(a23, o23));
     }
-    {
-        size_t s[2] = {512, 512};
-        size_t d = sizeof(s) / sizeof(size_t);
-        size_t i;
-        size_t n = 100;
-        tensor a = tensor_random(1, d, s);
-        tensor b = tensor_random(1, d, s);
-        double start = currtime();
-        for(i = 0; i < n; ++i){
-            tensor c = tensor_add(a, b);
-            tensor_free(c);
-        }
-        double end = currtime();
-        printf("tensor_add took %f sec\n", end - start);
-        printf("%g gflops\n", gflops(n*s[0]*s[1], (end-start)));
-
-        start = currtime();
-        for(i = 0; i < n; ++i){
-            tensor c = tensor_axpy(1, a, b);
-            tensor_free(c);
-        }
-        end = currtime();
-        printf("tensor_axpy took %f sec\n", end - start);
-        printf("%g gflops\n", gflops(1.0*n*s[0]*s[1], (end-start)));
-
-        start = currtime();
-        for(i = 0; i < n; ++i){
-            tensor c = tensor_mul(a, b);
-            tensor_free(c);
-        }
-        end = currtime();
-        printf("tensor_mul took %f sec\n", end - start);
-        printf("%g gflops\n", gflops(1.0*n*s[0]*s[1], (end-start)));
-
-        start = currtime();
-        for(i = 0; i < n; ++i){
-            tensor c = matrix_multiply(a, b);
-            tensor_free(c);
-        }
-        end = currtime();
-        printf("matrix_multiply took %f sec\n", end - start);
-        printf("%g gflops\n", gflops(1.0*n*s[0]*s[1]*s[1], (end-start)));
-    }
-    {
-        size_t s[4] = {512, 128, 2, 2};
-        size_t s2[4] = {512, 1, 2, 1};
-
-        size_t i;
-        size_t n = 100;
-        tensor a = tensor_random(1, 4, s);
-        tensor b = tensor_random(1, 4, s2);
-        double start = currtime();
-        for(i = 0; i < n; ++i){
-            tensor c = tensor_add(a, b);
-            tensor_free(c);
-        }
-        double end = currtime();
-        printf("tensor_add took %f sec\n", end - start);
-        printf("%g gflops\n", gflops(n*s[0]*s[1], (end-start)));
-
-        start = currtime();
-        for(i = 0; i < n; ++i){
-            tensor c = tensor_axpy(1, a, b);
-            tensor_free(c);
-        }
-        end = currtime();
-        printf("tensor_axpy took %f sec\n", end - start);
-        printf("%g gflops\n", gflops(n*s[0]*s[1], (end-start)));
-
-        start = currtime();
-        for(i = 0; i < n; ++i){
-            tensor c = tensor_mul(a, b);
-            tensor_free(c);
-        }
-        end = currtime();
-        printf("tensor_mul took %f sec\n", end - start);
-        printf("%g gflops\n", gflops(n*s[0]*s[1], (end-start)));
-    }
-    {
-        size_t s[4] = {512, 128, 2, 2};
-        size_t s2[1] = {1};
-
-        size_t i;
-        size_t n = 100;
-        tensor a = tensor_random(1, 4, s);
-        tensor b = tensor_random(1, 1, s2);
-        double start = currtime();
-        for(i = 0; i < n; ++i){
-            tensor c = tensor_add(a, b);
-            tensor_free(c);
-        }
-        double end = currtime();
-        printf("tensor_add took %f sec\n", end - start);
-        printf("%g gflops\n", gflops(n*s[0]*s[1], (end-start)));
-
-        start = currtime();
-        for(i = 0; i < n; ++i){
-            tensor c = tensor_axpy(1, a, b);
-            tensor_free(c);
-        }
-        end = currtime();
-        printf("tensor_axpy took %f sec\n", end - start);
-        printf("%g gflops\n", gflops(n*s[0]*s[1], (end-start)));
-
-        start = currtime();
-        for(i = 0; i < n; ++i){
-            tensor c = tensor_mul(a, b);
-            tensor_free(c);
-        }
-        end = currtime();
-        printf("tensor_mul took %f sec\n", end - start);
-        printf("%g gflops\n", gflops(n*s[0]*s[1], (end-start)));
-    }
     // Conv example
     {
         size_t im_s[3] = {3, 512, 256};
         size_t f_s[4] = {8, 3, 3, 3};
         size_t stride = 1;
         size_t pad = 1;
-        size_t n = 100;
-        size_t i = 0;
 
         tensor f = tensor_random(1, 4, f_s);
         tensor im = tensor_random(1, 3, im_s);
-        double start = currtime();
-        for(i = 0; i < n; ++i){
-            tensor c = conv2d(im, f, stride, pad);
-            tensor_free(c);
-        }
-        double end = currtime();
         tensor c = conv2d(im, f, stride, pad);
-        printf("conv2d took %f sec\n", end - start);
-        printf("conv output %ld x %ld x %ld\n", c.size[0], c.size[1], c.size[2]);
-        printf("%g gflops\n", n*gflops(f_s[0]*f_s[1]*f_s[2]*f_s[3]*im_s[1]/stride*im_s[2]/stride, (end-start)));
+        TEST (c.size[0] == 8);
+        TEST (c.size[1] == 512);
+        TEST (c.size[2] == 256);
         tensor c_slow = conv2d_slow(im, f, stride, pad);
         TEST (same_tensor(c, c_slow));
     }
@@ -407,9 +284,1198 @@ void test_tensor()
     }
 }
 
+void copy_band(void *ctx, size_t y, tensor band)
+{
+    tensor *out = ctx;
+    size_t c;
+    size_t rows = band.size[1];
+    size_t w = band.size[2];
+    for(c = 0; c < band.size[0]; ++c){
+        memcpy(out->data + (c*out->size[1] + y)*w, band.data + c*rows*w, rows*w*sizeof(float));
+    }
+}
+
+void test_conv_stream()
+{
+    size_t im_s[3] = {3, 37, 29};
+    size_t f_s[4][4] = {{4, 3, 3, 3}, {2, 3, 5, 5}, {5, 3, 1, 1}, {3, 3, 3, 2}};
+    size_t strides[4] = {1, 2, 1, 3};
+    size_t pads[4] = {1, 2, 0, 4};
+    size_t band_hs[4] = {5, 1, 64, 2};
+    size_t i;
+    tensor im = tensor_random(1, 3, im_s);
+    for(i = 0; i < 4; ++i){
+        tensor f = tensor_random(1, 4, f_s[i]);
+        tensor c = conv2d(im, f, strides[i], pads[i]);
+        tensor s = tensor_make(3, c.size);
+        conv2d_stream(im_s[0], im_s[1], im_s[2], conv2d_tensor_producer, &im,
+                f, strides[i], pads[i], band_hs[i], copy_band, &s);
+        TEST (memcmp(c.data, s.data, tensor_len(c)*sizeof(float)) == 0);
+        tensor_free(f);
+        tensor_free(c);
+        tensor_free(s);
+    }
+    tensor_free(im);
+
+    // Large kernels: conv2d runs FFT and so does the stream, on bands
+    // rounded up to whole FFT tiles
+    size_t big_s[3] = {3, 96, 80};
+    size_t big_f[4] = {2, 3, 15, 15};
+    TEST (tune_conv2d_default(big_s, big_f, 1, 7) == CONV_FFT);
+    im = tensor_random(1, 3, big_s);
+    tensor f = tensor_random(1, 4, big_f);
+    tensor fc = conv2d(im, f, 1, 7);
+    tensor s = tensor_make(3, fc.size);
+    conv2d_stream(big_s[0], big_s[1], big_s[2], conv2d_tensor_producer, &im,
+            f, 1, 7, 16, copy_band, &s);
+    TEST (memcmp(fc.data, s.data, tensor_len(fc)*sizeof(float)) == 0);
+    tensor_free(im);
+    tensor_free(f);
+    tensor_free(fc);
+    tensor_free(s);
+
+    // Direct and Winograd, as a tuning cache would pick them
+    char path[] = "/tmp/tenswords_stream_XXXXXX";
+    int fd = mkstemp(path);
+    size_t tuned_s[3] = {2, 19, 13};
+    size_t tuned_f[2][4] = {{3, 2, 3, 3}, {2, 2, 4, 3}};
+    size_t tuned_stride[2] = {1, 2};
+    conv_algo tuned_algo[2] = {CONV_WINOGRAD, CONV_DIRECT};
+    TEST (fd >= 0);
+    FILE *fp = fdopen(fd, "w");
+    for(i = 0; i < 2; ++i){
+        fprintf(fp, "conv %zu %zu %zu %zu %zu %zu %zu %d %d %s\n", tuned_s[0], tuned_s[1], tuned_s[2],
+                tuned_f[i][0], tuned_f[i][2], tuned_f[i][3], tuned_stride[i], 1, tuned_algo[i], tune_cpu_model());
+    }
+    fclose(fp);
+    TEST (tune_set_cache(path) == 2);
+    im = tensor_random(1, 3, tuned_s);
+    for(i = 0; i < 2; ++i){
+        TEST (tune_conv2d(tuned_s, tuned_f[i], tuned_stride[i], 1) == tuned_algo[i]);
+        f = tensor_random(1, 4, tuned_f[i]);
+        fc = conv2d(im, f, tuned_stride[i], 1);
+        s = tensor_make(3, fc.size);
+        conv2d_stream(tuned_s[0], tuned_s[1], tuned_s[2], conv2d_tensor_producer, &im,
+                f, tuned_stride[i], 1, 3, copy_band, &s);
+        TEST (memcmp(fc.data, s.data, tensor_len(fc)*sizeof(float)) == 0);
+        tensor_free(f);
+        tensor_free(fc);
+        tensor_free(s);
+    }
+    tune_set_cache(0);
+    unlink(path);
+    tensor_free(im);
+}
+
+void test_prof()
+{
+    size_t im_s[3] = {3, 32, 32};
+    size_t f_s[4] = {4, 3, 3, 3};
+    tensor im = tensor_random(1, 3, im_s);
+    tensor f = tensor_random(1, 4, f_s);
+    int was = prof_enabled;
+    prof_enable(1);
+    prof_reset();
+    tensor c = conv2d(im, f, 1, 1);
+    TEST (prof_calls(PROF_CONV2D) == 1);
+    TEST (prof_calls(PROF_IM2COL) == 1);
+    TEST (prof_calls(PROF_MATRIX_MULTIPLY) == 1);
+    TEST (prof_peak_bytes() >= tensor_len(c)*sizeof(float));
+
+    // Live bytes only move for buffers the profiler counted, whenever they
+    // are freed; prof_reset pulls the peak down to the live count
+    size_t b_s[1] = {4096};
+    prof_enable(0);
+    tensor before = tensor_make(1, b_s);
+    prof_enable(1);
+    prof_reset();
+    size_t base = prof_peak_bytes();
+    tensor_free(before);
+    prof_reset();
+    TEST (prof_peak_bytes() == base);
+    tensor during = tensor_make(1, b_s);
+    TEST (prof_peak_bytes() == base + sizeof(float)*4096);
+    prof_enable(0);
+    tensor_free(during);
+    prof_enable(1);
+    prof_reset();
+    TEST (prof_peak_bytes() == base);
+    prof_enable(was);
+    tensor_free(im);
+    tensor_free(f);
+    tensor_free(c);
+}
+
+void test_conv_algos()
+{
+    size_t im_s[3] = {3, 23, 18};
+    size_t f_s[4][4] = {{4, 3, 3, 3}, {2, 3, 3, 3}, {5, 3, 1, 1}, {3, 3, 5, 2}};
+    size_t strides[4] = {1, 1, 1, 2};
+    size_t pads[4] = {1, 0, 0, 3};
+    size_t i;
+    int algo;
+    tensor im = tensor_random(1, 3, im_s);
+    for(i = 0; i < 4; ++i){
+        tensor f = tensor_random(1, 4, f_s[i]);
+        tensor slow = conv2d_slow(im, f, strides[i], pads[i]);
+        for(algo = 0; algo < CONV_NALGOS; ++algo){
+            tensor c = conv2d_algo(im, f, strides[i], pads[i], algo);
+            TEST (same_tensor(c, slow));
+            tensor_free(c);
+        }
+        tensor_free(f);
+        tensor_free(slow);
+    }
+
+    // Repeated FFT calls reuse the cached filter spectra until the
+    // filters are written
+    tensor f = tensor_random(1, 4, f_s[0]);
+    tensor c1 = conv2d_algo(im, f, 1, 1, CONV_FFT);
+    tensor c2 = conv2d_algo(im, f, 1, 1, CONV_FFT);
+    TEST (memcmp(c1.data, c2.data, tensor_len(c1)*sizeof(float)) == 0);
+    tensor_mutable(&f)[0] += 1;
+    tensor g = tensor_copy(f);
+    tensor c3 = conv2d_algo(im, f, 1, 1, CONV_FFT);
+    tensor c4 = conv2d_algo(im, g, 1, 1, CONV_FFT);
+    TEST (memcmp(c3.data, c4.data, tensor_len(c3)*sizeof(float)) == 0);
+    TEST (memcmp(c1.data, c3.data, tensor_len(c1)*sizeof(float)) != 0);
+    tensor_free(f);
+    tensor_free(g);
+    tensor_free(c1);
+    tensor_free(c2);
+    tensor_free(c3);
+    tensor_free(c4);
+    tensor_free(im);
+}
+
+void test_tune()
+{
+    char path[] = "/tmp/tenswords_tune_XXXXXX";
+    int fd = mkstemp(path);
+    size_t im_s[3] = {2, 16, 16};
+    size_t f_s[4] = {4, 2, 3, 3};
+    size_t sa[2] = {24, 40};
+    size_t sb[2] = {40, 33};
+    TEST (fd >= 0);
+    close(fd);
+    TEST (tune_set_cache(path) == 0);
+    tune_enable(1);
+
+    tensor im = tensor_random(1, 3, im_s);
+    tensor f = tensor_random(1, 4, f_s);
+    tensor c = conv2d(im, f, 1, 1);
+    tensor slow = conv2d_slow(im, f, 1, 1);
+    TEST (same_tensor(c, slow));
+
+    tensor a = tensor_random(1, 2, sa);
+    tensor b = tensor_random(1, 2, sb);
+    tensor ab = matrix_multiply(a, b);
+
+    // Searches time their own operands and leave tensor_random's sequence
+    // where it was
+    size_t rs[1] = {16};
+    tensor_random_seed(99);
+    tune_gemm_search(8, 12, 10);
+    tune_conv2d_search(im_s, f_s, 1, 0);
+    tensor r1 = tensor_random(1, 1, rs);
+    tensor_random_seed(99);
+    tensor r2 = tensor_random(1, 1, rs);
+    TEST (memcmp(r1.data, r2.data, 16*sizeof(float)) == 0);
+    tensor_free(r1);
+    tensor_free(r2);
+    tune_enable(0);
+
+    // Reloading finds both tuned shapes for this CPU
+    TEST (tune_set_cache(path) >= 2);
+    gemm_config cfg = tune_gemm(24, 40, 33);
+    tensor ab2 = matrix_multiply_config(a, b, cfg);
+    TEST (memcmp(ab.data, ab2.data, tensor_len(ab)*sizeof(float)) == 0);
+    TEST (conv2d_algo_supported(tune_conv2d(im_s, f_s, 1, 1), f_s, 1, 1));
+
+    // Enough shapes to grow the lookup table a few times; the repeated
+    // shape keeps its last value
+    FILE *fp = fopen(path, "w");
+    size_t i;
+    int hits = 0;
+    for(i = 0; i < 100; ++i) fprintf(fp, "gemm %zu 7 9 %zu 0 %s\n", i + 1, i, tune_cpu_model());
+    fprintf(fp, "gemm 5 7 9 32 0 %s\n", tune_cpu_model());
+    fclose(fp);
+    TEST (tune_set_cache(path) == 100);
+    for(i = 0; i < 100; ++i) hits += tune_gemm(i + 1, 7, 9).bk == (i == 4 ? 32 : i);
+    TEST (hits == 100);
+
+    tune_set_cache(0);
+    unlink(path);
+    tensor_free(im);
+    tensor_free(f);
+    tensor_free(c);
+    tensor_free(slow);
+    tensor_free(a);
+    tensor_free(b);
+    tensor_free(ab);
+    tensor_free(ab2);
+}
+
+void test_random()
+{
+    // Known answers from the Random123 Philox4x32-10 test vectors
+    uint32_t zero[4] = {0, 0, 0, 0};
+    uint32_t ones[4] = {0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff};
+    uint32_t out[4];
+    philox4x32(zero, zero, out);
+    TEST (out[0] == 0x6627e8d5 && out[1] == 0xe169c58d && out[2] == 0xbc57ac4c && out[3] == 0x9b00dbd8);
+    philox4x32(ones, ones, out);
+    TEST (out[0] == 0x408f276d && out[1] == 0x41c83b0e && out[2] == 0xa20bc7c6 && out[3] == 0x6d5451fd);
+
+    size_t s[2] = {1001, 999};
+    size_t i;
+    tensor u = tensor_random_uniform(42, -2, 3, 2, s);
+    tensor u2 = tensor_random_uniform(42, -2, 3, 2, s);
+    tensor u3 = tensor_random_uniform(43, -2, 3, 2, s);
+    tensor n = tensor_random_normal(7, 1, 2, 2, s);
+    tensor tn = tensor_random_truncated_normal(7, 1, 2, 2, s);
+    size_t len = tensor_len(u);
+    TEST (memcmp(u.data, u2.data, len*sizeof(float)) == 0);
+    TEST (memcmp(u.data, u3.data, len*sizeof(float)) != 0);
+
+    double umin = 0, umax = 0, usum = 0, nsum = 0, nsq = 0, tmin = 1, tmax = 1;
+    for(i = 0; i < len; ++i){
+        if(i == 0 || u.data[i] < umin) umin = u.data[i];
+        if(i == 0 || u.data[i] > umax) umax = u.data[i];
+        usum += u.data[i];
+        nsum += n.data[i];
+        nsq += (n.data[i] - 1)*(n.data[i] - 1);
+        if(tn.data[i] < tmin) tmin = tn.data[i];
+        if(tn.data[i] > tmax) tmax = tn.data[i];
+    }
+    TEST (umin >= -2 && umax < 3);
+    TEST (fabs(usum/len - .5) < .01);
+    TEST (fabs(nsum/len - 1) < .01);
+    TEST (fabs(sqrt(nsq/len) - 2) < .01);
+    TEST (tmin >= -3 && tmax <= 5);
+
+    // Prefix of a longer fill matches a shorter one
+    size_t s1[1] = {7};
+    tensor p = tensor_random_uniform(42, -2, 3, 1, s1);
+    TEST (memcmp(p.data, u.data, 7*sizeof(float)) == 0);
+    tensor tp = tensor_random_truncated_normal(7, 1, 2, 1, s1);
+    TEST (memcmp(tp.data, tn.data, 7*sizeof(float)) == 0);
+
+    tensor_free(u);
+    tensor_free(u2);
+    tensor_free(u3);
+    tensor_free(n);
+    tensor_free(tn);
+    tensor_free(p);
+    tensor_free(tp);
+}
+
+void test_sparse()
+{
+    size_t sa[2] = {48, 36};
+    size_t sb[2] = {36, 29};
+    tensor a = tensor_random(1, 2, sa);
+    tensor b = tensor_random(1, 2, sb);
+
+    csr s = csr_from_tensor(a, .8);
+    tensor pruned = csr_to_tensor(s);
+    TEST (s.nnz > 0 && s.nnz < tensor_len(a)/2);
+    TEST (s.row_ptr[s.rows] == s.nnz);
+    tensor dense = matrix_multiply(pruned, b);
+    tensor sparse = csr_matrix_multiply(s, b);
+    TEST (same_tensor(dense, sparse));
+
+    bcsr bs = bcsr_from_tensor(pruned, 4, 3, 0);
+    tensor bsparse = bcsr_matrix_multiply(bs, b);
+    TEST (bs.nblocks <= tensor_len(a)/12);
+    TEST (same_tensor(dense, bsparse));
+
+    size_t im_s[3] = {3, 19, 17};
+    size_t f_s[4] = {6, 3, 3, 3};
+    tensor im = tensor_random(1, 3, im_s);
+    tensor f = tensor_random(1, 4, f_s);
+    csr sf = csr_from_tensor(f, .7);
+    tensor pf = csr_to_tensor(sf);
+    pf.n = 4;
+    free(pf.size);
+    pf.size = calloc(4, sizeof(size_t));
+    memcpy(pf.size, f_s, sizeof(f_s));
+    tensor c = conv2d(im, pf, 2, 1);
+    tensor cs = conv2d_sparse(im, sf, 3, 3, 2, 1);
+    TEST (same_tensor(c, cs));
+
+    csr_free(s);
+    bcsr_free(bs);
+    csr_free(sf);
+    tensor_free(a);
+    tensor_free(b);
+    tensor_free(pruned);
+    tensor_free(dense);
+    tensor_free(sparse);
+    tensor_free(bsparse);
+    tensor_free(im);
+    tensor_free(f);
+    tensor_free(pf);
+    tensor_free(c);
+    tensor_free(cs);
+}
+
+float residual(tensor A, tensor x, tensor b)
+{
+    size_t n = tensor_len(b);
+    size_t i;
+    float *Ax = calloc(n, sizeof(float));
+    double num = 0, den = 0;
+    matvec_dense(&A, x.data, Ax);
+    for(i = 0; i < n; ++i){
+        num += (Ax[i] - b.data[i])*(Ax[i] - b.data[i]);
+        den += b.data[i]*b.data[i];
+    }
+    free(Ax);
+    return sqrt(num/den);
+}
+
+void test_krylov()
+{
+    size_t n = 60;
+    size_t s[2] = {n, n};
+    size_t sb[2] = {n, 1};
+    size_t i;
+    solver_stats stats;
+    solver_opts opts = solver_defaults();
+
+    // Symmetric positive definite: R^T R + I
+    tensor R = tensor_random(1, 2, s);
+    tensor Rt = matrix_transpose(R);
+    tensor A = matrix_multiply(Rt, R);
+    for(i = 0; i < n; ++i) A.data[i*n + i] += 1;
+    tensor b = tensor_random(1, 2, sb);
+
+    tensor x = solve_cg(A, b, opts, &stats);
+    TEST (stats.converged);
+    TEST (residual(A, x, b) < 1e-4);
+    tensor direct = solve_system(A, b);
+    TEST (same_tensor(x, direct));
+
+    opts.jacobi = 1;
+    tensor xj = solve_cg(A, b, opts, &stats);
+    TEST (stats.converged);
+    TEST (residual(A, xj, b) < 1e-4);
+
+    // Nonsymmetric and diagonally dominant, with restarts
+    tensor N = tensor_random(1, 2, s);
+    for(i = 0; i < n; ++i) N.data[i*n + i] += n/4;
+    opts.restart = 4;
+    tensor xg = solve_gmres(N, b, opts, &stats);
+    TEST (stats.converged);
+    TEST (stats.iterations > 4);
+    TEST (residual(N, xg, b) < 1e-4);
+
+    // Jacobi with zeros on the diagonal: swapping two rows keeps N
+    // nonsingular, the preconditioner treats those entries as 1
+    tensor Z = tensor_copy(N);
+    float *zd = tensor_mutable(&Z);
+    for(i = 0; i < n; ++i){
+        float t = zd[i];
+        zd[i] = zd[n + i];
+        zd[n + i] = t;
+    }
+    zd[0] = zd[n + 1] = 0;
+    tensor xz = solve_gmres(Z, b, opts, &stats);
+    TEST (stats.converged);
+    TEST (residual(Z, xz, b) < 1e-4);
+
+    // 1-D Laplacian with a varying diagonal through the csr operator
+    size_t m = 2000;
+    csr L = {m, m, 3*m - 2};
+    L.row_ptr = calloc(m + 1, sizeof(size_t));
+    L.col_idx = calloc(L.nnz, sizeof(size_t));
+    L.vals = calloc(L.nnz, sizeof(float));
+    size_t k = 0;
+    for(i = 0; i < m; ++i){
+        if(i > 0){ L.col_idx[k] = i-1; L.vals[k++] = -1; }
+        L.col_idx[k] = i; L.vals[k++] = 2.5 + (i % 7);
+        if(i + 1 < m){ L.col_idx[k] = i+1; L.vals[k++] = -1; }
+        L.row_ptr[i+1] = k;
+    }
+    size_t sl[1] = {m};
+    tensor bl = tensor_random(1, 1, sl);
+    float *diag = csr_diagonal(L);
+    solver_opts lopts = solver_defaults();
+    lopts.jacobi = 1;
+    lopts.diag = diag;
+    tensor xl = solve_cg_op(m, matvec_csr, &L, bl, lopts, &stats);
+    TEST (stats.converged);
+    tensor xlg = solve_gmres_op(m, matvec_csr, &L, bl, lopts, &stats);
+    TEST (stats.converged);
+    TEST (same_tensor(xl, xlg));
+
+    free(diag);
+    csr_free(L);
+    tensor_free(R);
+    tensor_free(Rt);
+    tensor_free(A);
+    tensor_free(b);
+    tensor_free(x);
+    tensor_free(direct);
+    tensor_free(xj);
+    tensor_free(N);
+    tensor_free(xg);
+    tensor_free(Z);
+    tensor_free(xz);
+    tensor_free(bl);
+    tensor_free(xl);
+    tensor_free(xlg);
+}
+
+void test_cow()
+{
+    size_t s[2] = {17, 9};
+    tensor a = tensor_random(1, 2, s);
+    tensor b = tensor_copy(a);
+    TEST (b.data == a.data);
+    TEST (tensor_shared(a) && tensor_shared(b));
+
+    // First write through b gives it its own buffer, a is untouched
+    float before = a.data[3];
+    tensor_mutable(&b)[3] = before + 1;
+    TEST (b.data != a.data);
+    TEST (a.data[3] == before);
+    TEST (!tensor_shared(a) && !tensor_shared(b));
+    float *data = b.data;
+    TEST (tensor_mutable(&b) == data);
+
+    // Handles can be released in any order
+    tensor c = tensor_retain(a);
+    tensor d = tensor_copy(c);
+    tensor_free(a);
+    TEST (tensor_shared(c));
+    tensor_release(c);
+    TEST (!tensor_shared(d));
+    TEST (d.data[3] == before);
+
+    tensor w = tensor_scale(d, 2);
+    TEST (within_eps(w.data[3], 2*before));
+    TEST (d.data[3] == before);
+
+    // Filling a shared tensor copies it first
+    tensor e = tensor_copy(d);
+    tensor_fill_uniform(&e, 1, 5, 6);
+    TEST (d.data[3] == before);
+    TEST (e.data[3] >= 5);
+
+    // So does accumulating a product into one
+    size_t sm[2] = {4, 4};
+    tensor m = tensor_random(1, 2, sm);
+    tensor orig = tensor_make(2, sm);
+    memcpy(orig.data, m.data, 16*sizeof(float));
+    tensor acc = tensor_copy(m);
+    tensor sq = matrix_multiply(m, m);
+    tensor sum = tensor_add(m, sq);
+    matrix_multiply_into(m, m, &acc, tune_gemm(4, 4, 4));
+    TEST (acc.data != m.data);
+    TEST (same_tensor(acc, sum));
+    TEST (memcmp(m.data, orig.data, 16*sizeof(float)) == 0);
+
+    tensor_free(m);
+    tensor_free(orig);
+    tensor_free(acc);
+    tensor_free(sq);
+    tensor_free(sum);
+    tensor_free(b);
+    tensor_free(d);
+    tensor_free(w);
+    tensor_free(e);
+}
+
+static tensor scale_task(const tensor *in, void *ctx)
+{
+    return tensor_scale(in[0], *(float *)ctx);
+}
+
+// Copies its input only when it gets the null ctx it was submitted with
+static tensor null_ctx_task(const tensor *in, void *ctx)
+{
+    return tensor_scale(in[0], ctx ? 0 : 1);
+}
+
+void test_queue()
+{
+    size_t im_s[3] = {3, 23, 19};
+    size_t f_s[4] = {4, 3, 3, 3};
+    size_t b_s[3] = {4, 1, 1};
+    size_t frames = 6;
+    size_t i;
+    queue *q = queue_make(3);
+    future *f = future_ready(tensor_random(1, 4, f_s));
+    future *bias = future_ready(tensor_random(1, 3, b_s));
+    future *gain = future_ready(tensor_random(1, 3, b_s));
+    tensor ims[6];
+    future *outs[6];
+
+    // Pipeline of frames, every stage waits on the one before it
+    for(i = 0; i < frames; ++i){
+        ims[i] = tensor_random(1, 3, im_s);
+        future *im = future_ready(tensor_retain(ims[i]));
+        future *c = queue_conv2d(q, im, f, 1, 1);
+        future *a = queue_add(q, c, bias);
+        outs[i] = queue_mul(q, a, gain);
+        future_free(im);
+        future_free(c);
+        future_free(a);
+    }
+
+    tensor ft = future_get(f);
+    tensor bt = future_get(bias);
+    tensor gt = future_get(gain);
+    for(i = 0; i < frames; ++i){
+        tensor c = conv2d(ims[i], ft, 1, 1);
+        tensor a = tensor_add(c, bt);
+        tensor m = tensor_mul(a, gt);
+        tensor r = future_get(outs[i]);
+        TEST (future_done(outs[i]));
+        TEST (memcmp(r.data, m.data, tensor_len(m)*sizeof(float)) == 0);
+        tensor_free(c);
+        tensor_free(a);
+        tensor_free(m);
+        tensor_free(r);
+        tensor_free(ims[i]);
+        future_free(outs[i]);
+    }
+
+    // Chain of custom ops, the last future is dropped before it is done
+    float two = 2;
+    future *x = future_ready(tensor_retain(bt));
+    for(i = 0; i < 4; ++i){
+        future *y = queue_submit(q, scale_task, &two, &x, 1);
+        future_free(x);
+        x = y;
+    }
+    future *z = queue_axpy(q, -16, gain, x);
+    future_free(x);
+    queue_sync(q);
+    tensor zt = future_get(z);
+    tensor b16 = tensor_scale(bt, 16);
+    tensor expect = tensor_axpy(-16, gt, b16);
+    TEST (same_tensor(zt, expect));
+
+    // A null ctx reaches the op unchanged
+    future *n = queue_submit(q, null_ctx_task, 0, &bias, 1);
+    tensor nt = future_get(n);
+    TEST (same_tensor(nt, bt));
+    tensor_free(nt);
+    future_free(n);
+
+    // Results stay readable after the queue is gone
+    future *w = queue_add(q, bias, gain);
+    queue_free(q);
+    TEST (future_done(w));
+    tensor wt = future_get(w);
+    tensor wexpect = tensor_add(bt, gt);
+    TEST (same_tensor(wt, wexpect));
+
+    tensor_free(wt);
+    tensor_free(wexpect);
+    tensor_free(zt);
+    tensor_free(expect);
+    tensor_free(b16);
+    tensor_free(ft);
+    tensor_free(bt);
+    tensor_free(gt);
+    future_free(w);
+    future_free(z);
+    future_free(f);
+    future_free(bias);
+    future_free(gain);
+}
+
+void test_conv_plan()
+{
+    size_t im_s[3] = {3, 21, 17};
+    // The last filter covers the whole image, one output pixel
+    size_t f_s[6][4] = {{4, 3, 3, 3}, {2, 3, 5, 5}, {5, 3, 1, 1}, {3, 3, 3, 2}, {2, 3, 1, 1}, {3, 3, 21, 17}};
+    size_t strides[6] = {1, 2, 1, 3, 2, 2};
+    size_t pads[6] = {1, 2, 0, 4, 1, 0};
+    size_t i, j;
+    for(i = 0; i < 6; ++i){
+        tensor f = tensor_random(1, 4, f_s[i]);
+        conv2d_plan *p = conv2d_plan_create(im_s, f_s[i], strides[i], pads[i]);
+        conv2d_plan_set_filters(p, f);
+        tensor out = conv2d_plan_output(p);
+        // Later writes to the caller's filters don't reach the plan
+        tensor g = tensor_copy(f);
+        tensor_mutable(&f)[0] = 100;
+        for(j = 0; j < 2; ++j){
+            tensor im = tensor_random(1, 3, im_s);
+            tensor c = conv2d_algo(im, g, strides[i], pads[i], CONV_IM2COL);
+            conv2d_plan_execute(p, im, &out);
+            TEST (memcmp(c.data, out.data, tensor_len(c)*sizeof(float)) == 0);
+            tensor_free(im);
+            tensor_free(c);
+        }
+        tensor_free(out);
+        tensor_free(f);
+        tensor_free(g);
+        conv2d_plan_free(p);
+    }
+}
+
+// Loss sum(conv2d_slow(im, f) * g), linear in both im and f
+static double conv_loss(tensor im, tensor f, tensor g, size_t stride, size_t pad)
+{
+    tensor c = conv2d_slow(im, f, stride, pad);
+    double sum = 0;
+    size_t i;
+    for(i = 0; i < tensor_len(c); ++i) sum += (double)c.data[i]*g.data[i];
+    tensor_free(c);
+    return sum;
+}
+
+// Central difference of conv_loss along element i of t
+static double conv_loss_diff(tensor im, tensor f, tensor g, size_t stride, size_t pad, tensor *t, size_t i)
+{
+    float eps = .25f;
+    float *data = tensor_mutable(t);
+    float v = data[i];
+    data[i] = v + eps;
+    double hi = conv_loss(im, f, g, stride, pad);
+    data[i] = v - eps;
+    double lo = conv_loss(im, f, g, stride, pad);
+    data[i] = v;
+    return (hi - lo)/(2*eps);
+}
+
+void test_conv_backward()
+{
+    size_t im_s[3] = {2, 9, 8};
+    size_t f_s[4][4] = {{3, 2, 3, 3}, {2, 2, 1, 1}, {2, 2, 3, 2}, {3, 2, 4, 4}};
+    size_t strides[4] = {1, 1, 2, 3};
+    size_t pads[4] = {1, 0, 2, 1};
+    size_t i, j;
+    for(i = 0; i < 4; ++i){
+        tensor im = tensor_random(1, 3, im_s);
+        tensor f = tensor_random(1, 4, f_s[i]);
+        tensor c = conv2d(im, f, strides[i], pads[i]);
+        tensor g = tensor_random(1, 3, c.size);
+        tensor dim = conv2d_backward_input(g, f, im_s, strides[i], pads[i]);
+        tensor df = conv2d_backward_filter(g, im, f_s[i], strides[i], pads[i]);
+
+        int ok = 1;
+        for(j = 0; j < tensor_len(im); ++j){
+            double d = conv_loss_diff(im, f, g, strides[i], pads[i], &im, j);
+            if(fabs(d - dim.data[j]) > 1e-3*(1 + fabs(d))) ok = 0;
+        }
+        TEST (ok);
+        ok = 1;
+        for(j = 0; j < tensor_len(f); ++j){
+            double d = conv_loss_diff(im, f, g, strides[i], pads[i], &f, j);
+            if(fabs(d - df.data[j]) > 1e-3*(1 + fabs(d))) ok = 0;
+        }
+        TEST (ok);
+
+        // The plan's workspace is scratch for the input gradient, forward
+        // results after it must not change
+        conv2d_plan *p = conv2d_plan_create(im_s, f_s[i], strides[i], pads[i]);
+        conv2d_plan_set_filters(p, f);
+        tensor out = conv2d_plan_output(p);
+        conv2d_plan_backward_input(p, g, &dim);
+        conv2d_plan_execute(p, im, &out);
+        TEST (memcmp(c.data, out.data, tensor_len(c)*sizeof(float)) == 0);
+
+        // New filters replace the transposed ones the input gradient made
+        tensor f2 = tensor_random(1, 4, f_s[i]);
+        tensor dim2 = conv2d_backward_input(g, f2, im_s, strides[i], pads[i]);
+        conv2d_plan_set_filters(p, f2);
+        conv2d_plan_backward_input(p, g, &dim);
+        TEST (memcmp(dim.data, dim2.data, tensor_len(dim)*sizeof(float)) == 0);
+        tensor_free(f2);
+        tensor_free(dim2);
+
+        conv2d_plan_free(p);
+        tensor_free(out);
+        tensor_free(im);
+        tensor_free(f);
+        tensor_free(c);
+        tensor_free(g);
+        tensor_free(dim);
+        tensor_free(df);
+    }
+}
+
+void test_fft()
+{
+    size_t h = 8, w = 16, cols = w/2 + 1;
+    size_t s[2] = {h, w};
+    tensor x = tensor_random(1, 2, s);
+    float *spec = calloc(2*h*cols, sizeof(float));
+    float *work = calloc(2*h, sizeof(float));
+    float *back = calloc(h*w, sizeof(float));
+    size_t u, v, y, i;
+    fft2d_r2c(x.data, h, w, spec, work);
+
+    // Against the direct DFT
+    double err = 0;
+    for(u = 0; u < h; ++u){
+        for(v = 0; v < cols; ++v){
+            double re = 0, im = 0;
+            for(y = 0; y < h; ++y){
+                for(i = 0; i < w; ++i){
+                    double a = -2*M_PI*((double)u*y/h + (double)v*i/w);
+                    re += x.data[y*w + i]*cos(a);
+                    im += x.data[y*w + i]*sin(a);
+                }
+            }
+            err = fmax(err, fabs(re - spec[2*(u*cols + v)]));
+            err = fmax(err, fabs(im - spec[2*(u*cols + v)+1]));
+        }
+    }
+    TEST (err < 1e-4);
+
+    fft2d_c2r(spec, h, w, back, work);
+    err = 0;
+    for(i = 0; i < h*w; ++i) err = fmax(err, fabs(back[i]/(h*w) - x.data[i]));
+    TEST (err < 1e-5);
+
+    // Denoising sized kernels over several tiles, with and without padding
+    size_t im_s[3] = {2, 70, 45};
+    size_t f_s[3][4] = {{3, 2, 7, 7}, {2, 2, 15, 15}, {2, 2, 9, 4}};
+    size_t pads[3] = {3, 0, 5};
+    for(i = 0; i < 3; ++i){
+        tensor im = tensor_random(1, 3, im_s);
+        tensor f = tensor_random(1, 4, f_s[i]);
+        tensor slow = conv2d_slow(im, f, 1, pads[i]);
+        tensor c = conv2d_algo(im, f, 1, pads[i], CONV_FFT);
+        TEST (same_tensor(c, slow));
+        tensor_free(im);
+        tensor_free(f);
+        tensor_free(slow);
+        tensor_free(c);
+    }
+
+    // The cost model keeps small kernels on im2col and moves large ones to FFT
+    size_t big[3] = {3, 256, 256};
+    size_t f3[4] = {8, 3, 3, 3};
+    size_t f15[4] = {8, 3, 15, 15};
+    TEST (tune_conv2d_default(big, f3, 1, 1) == CONV_IM2COL);
+    TEST (tune_conv2d_default(big, f15, 1, 7) == CONV_FFT);
+    TEST (tune_conv2d_default(big, f15, 2, 7) == CONV_IM2COL);
+
+    tensor_free(x);
+    free(spec);
+    free(work);
+    free(back);
+}
+
+void test_norm()
+{
+    size_t s[3] = {3, 5, 700};
+    size_t cols = s[2], rows = 15;
+    size_t g_s[1] = {700};
+    tensor t = tensor_random(4, 3, s);
+    tensor gamma = tensor_random(1, 1, g_s);
+    tensor beta = tensor_random(1, 1, g_s);
+    tensor none = {0};
+    size_t i, j;
+
+    // ulp against double exp over the normal range, in steps that hit every
+    // reduction interval
+    double ulp = 0;
+    float x;
+    for(x = -87.3f; x < 88.3f; x += .0137f){
+        double ref = exp((double)x);
+        ulp = fmax(ulp, fabs(fast_expf(x) - ref)/ldexp(1, ilogb(ref) - 23));
+    }
+    TEST (ulp <= 2.5);
+    TEST (fast_expf(-200) == 0);
+    TEST (fast_expf(0) == 1);
+
+    // A ramp moves the max into later chunks, a large offset and a masked
+    // entry check the rescaling and underflow
+    for(i = 0; i < rows; ++i){
+        for(j = 0; j < cols; ++j) t.data[i*cols + j] += 1000 + .02f*j*(i%3);
+    }
+    tensor ln = tensor_layernorm(t, gamma, beta, 1e-5f);
+    tensor ln0 = tensor_layernorm(t, none, none, 1e-5f);
+    double ln_err = 0, ln0_err = 0;
+    for(i = 0; i < rows; ++i){
+        const float *x = t.data + i*cols;
+        double mean = 0, var = 0;
+        for(j = 0; j < cols; ++j) mean += x[j];
+        mean /= cols;
+        for(j = 0; j < cols; ++j) var += (x[j] - mean)*(x[j] - mean);
+        var /= cols;
+        for(j = 0; j < cols; ++j){
+            double n = (x[j] - mean)/sqrt(var + 1e-5);
+            ln_err = fmax(ln_err, fabs(ln.data[i*cols + j] - (n*gamma.data[j] + beta.data[j])));
+            ln0_err = fmax(ln0_err, fabs(ln0.data[i*cols + j] - n));
+        }
+    }
+    TEST (ln_err < 1e-3);
+    TEST (ln0_err < 1e-3);
+
+    for(i = 0; i < rows; ++i) t.data[i*cols + 3] = -1e30f;
+    tensor sm = tensor_softmax(t);
+    tensor lsm = tensor_log_softmax(t);
+
+    double sm_err = 0, lsm_err = 0;
+    for(i = 0; i < rows; ++i){
+        const float *x = t.data + i*cols;
+        double m = x[0], sum = 0;
+        for(j = 0; j < cols; ++j) m = fmax(m, x[j]);
+        for(j = 0; j < cols; ++j) sum += exp(x[j] - m);
+        for(j = 0; j < cols; ++j){
+            double p = exp(x[j] - m)/sum;
+            sm_err = fmax(sm_err, fabs(sm.data[i*cols + j] - p)/fmax(p, 1e-30));
+            if(j != 3) lsm_err = fmax(lsm_err, fabs(lsm.data[i*cols + j] - (x[j] - m - log(sum))));
+        }
+    }
+    TEST (sm_err < 1e-5);
+    TEST (sm.data[3] == 0);
+    TEST (lsm_err < 1e-4);
+
+    tensor_free(t);
+    tensor_free(gamma);
+    tensor_free(beta);
+    tensor_free(sm);
+    tensor_free(lsm);
+    tensor_free(ln);
+    tensor_free(ln0);
+}
+
+static double test_gelu_(double x)
+{
+    return .5*x*(1 + tanh(0.7978845608028654*(x + .044715*x*x*x)));
+}
+
+// Worst ulp error of op over a tensor of inputs against a double reference
+static double test_unary_ulp_(tensor x, unary_op op, double ref (double))
+{
+    tensor y = tensor_unary(x, op);
+    size_t len = tensor_len(x);
+    size_t i;
+    double ulp = 0;
+    for(i = 0; i < len; ++i){
+        double r = ref(x.data[i]);
+        if(r == 0) continue;
+        ulp = fmax(ulp, fabs(y.data[i] - r)/ldexp(1, ilogb(r) - 23));
+    }
+    tensor_free(y);
+    return ulp;
+}
+
+static double test_sigmoid_(double x)
+{
+    return 1/(1 + exp(-x));
+}
+
+void test_unary()
+{
+    // Big enough for the threaded path, random over the ranges the bounds
+    // in fastmath.h hold for. These check whichever kernels were compiled
+    // in, libmvec or the polynomials.
+    size_t s[2] = {64, 2048};
+    size_t len = 64*2048;
+    size_t i;
+    tensor x = tensor_random_uniform(7, -80, 80, 2, s);
+    tensor pos = tensor_random_uniform(8, -87, 88, 2, s);
+    tensor small = tensor_random_uniform(9, -1, 6, 2, s);
+    for(i = 0; i < len; ++i) pos.data[i] = expf(pos.data[i]);
+
+    TEST (test_unary_ulp_(x, UNARY_EXP, exp) <= FASTMATH_EXP_ULP);
+    TEST (test_unary_ulp_(pos, UNARY_LOG, log) <= FASTMATH_LOG_ULP);
+    TEST (test_unary_ulp_(pos, UNARY_SQRT, sqrt) <= 3);
+    TEST (test_unary_ulp_(x, UNARY_TANH, tanh) <= FASTMATH_TANH_ULP);
+    TEST (test_unary_ulp_(small, UNARY_TANH, tanh) <= FASTMATH_TANH_ULP);
+    TEST (test_unary_ulp_(x, UNARY_SIGMOID, test_sigmoid_) <= 6);
+    TEST (test_unary_ulp_(small, UNARY_GELU, test_gelu_) <= 5);
+
+    tensor r = tensor_relu(x);
+    int relu_ok = 1;
+    for(i = 0; i < len; ++i) relu_ok &= r.data[i] == (x.data[i] > 0 ? x.data[i] : 0);
+    TEST (relu_ok);
+
+    // The portable polynomials, which the kernels above may not have used
+    double exp_ulp = 0, log_ulp = 0, tanh_ulp = 0;
+    float v;
+    for(v = -87.3f; v < 88.3f; v += .00037f){
+        exp_ulp = fmax(exp_ulp, fabs(fast_expf(v) - exp(v))/ldexp(1, ilogb(exp(v)) - 23));
+    }
+    for(v = 1e-30f; v < 1e30f; v *= 1.0013f){
+        log_ulp = fmax(log_ulp, fabs(fast_logf(v) - log(v))/ldexp(1, ilogb(log(v)) - 23));
+    }
+    for(v = -10; v < 10; v += .00037f){
+        if(v == 0) continue;
+        tanh_ulp = fmax(tanh_ulp, fabs(fast_tanhf(v) - tanh(v))/ldexp(1, ilogb(tanh(v)) - 23));
+    }
+    TEST (exp_ulp <= 2.5);
+    TEST (log_ulp <= 5);
+    TEST (tanh_ulp <= 2.5);
+
+    // In place writes through tensor_mutable, the other handle keeps the
+    // input. _into matches the allocating version.
+    tensor c = tensor_copy(small);
+    tensor_unary_inplace(&c, UNARY_GELU);
+    tensor g = tensor_gelu(small);
+    tensor into = tensor_make(2, s);
+    tensor_unary_into(small, UNARY_GELU, &into);
+    tensor orig = tensor_random_uniform(9, -1, 6, 2, s);
+    int same = 1, kept = 1;
+    for(i = 0; i < len; ++i){
+        same &= c.data[i] == g.data[i] && into.data[i] == g.data[i];
+        kept &= small.data[i] == orig.data[i];
+    }
+    TEST (same);
+    TEST (c.buf != small.buf && kept);
+
+    tensor_free(x);
+    tensor_free(pos);
+    tensor_free(small);
+    tensor_free(r);
+    tensor_free(c);
+    tensor_free(g);
+    tensor_free(into);
+    tensor_free(orig);
+}
+
+// Pooling straight from the definition, padding taps skipped
+static tensor test_pool_slow_(tensor im, pool_type type, size_t size, size_t stride, size_t pad)
+{
+    size_t h = im.size[1], w = im.size[2];
+    size_t oh = (h + 2*pad - size)/stride + 1;
+    size_t ow = (w + 2*pad - size)/stride + 1;
+    tensor r = tensor_vmake(3, im.size[0], oh, ow);
+    size_t c, oy, ox, dy, dx;
+    for(c = 0; c < im.size[0]; ++c){
+        for(oy = 0; oy < oh; ++oy){
+            for(ox = 0; ox < ow; ++ox){
+                double m = -1e30, sum = 0;
+                size_t n = 0;
+                for(dy = 0; dy < size; ++dy){
+                    for(dx = 0; dx < size; ++dx){
+                        long y = (long)(oy*stride + dy) - (long)pad;
+                        long x = (long)(ox*stride + dx) - (long)pad;
+                        if(y < 0 || x < 0 || y >= (long)h || x >= (long)w) continue;
+                        float v = im.data[(c*h + y)*w + x];
+                        m = fmax(m, v);
+                        sum += v;
+                        ++n;
+                    }
+                }
+                r.data[(c*oh + oy)*ow + ox] = type == POOL_MAX ? m : sum/n;
+            }
+        }
+    }
+    return r;
+}
+
+void test_pool()
+{
+    struct {
+        size_t im[3];
+        size_t f[4];
+        size_t stride, pad;
+        unary_op act;
+        pool_type type;
+        size_t size, pool_stride, pool_pad;
+    } cases[] = {
+        {{8, 32, 32}, {16, 8, 3, 3}, 1, 1, UNARY_RELU, POOL_MAX, 2, 2, 0},
+        {{3, 29, 31}, {8, 3, 3, 3}, 1, 1, UNARY_GELU, POOL_AVG, 3, 2, 1},
+        {{4, 40, 24}, {6, 4, 5, 5}, 2, 2, UNARY_IDENTITY, POOL_MAX, 3, 1, 1},
+        // Several bands, the second with windows overlapping across them
+        {{16, 64, 64}, {32, 16, 3, 3}, 1, 1, UNARY_SIGMOID, POOL_MAX, 2, 2, 0},
+        {{16, 64, 64}, {32, 16, 3, 3}, 1, 1, UNARY_TANH, POOL_AVG, 3, 2, 1},
+    };
+    size_t i;
+    for(i = 0; i < sizeof(cases)/sizeof(cases[0]); ++i){
+        tensor im = tensor_random(1, 3, cases[i].im);
+        tensor f = tensor_random(.3, 4, cases[i].f);
+        tensor c = conv2d_algo(im, f, cases[i].stride, cases[i].pad, CONV_IM2COL);
+        tensor a = tensor_unary(c, cases[i].act);
+        tensor p = pool2d(a, cases[i].type, cases[i].size, cases[i].pool_stride, cases[i].pool_pad);
+        tensor slow = test_pool_slow_(a, cases[i].type, cases[i].size, cases[i].pool_stride, cases[i].pool_pad);
+        tensor fused = conv2d_act_pool(im, f, cases[i].stride, cases[i].pad, cases[i].act,
+                cases[i].type, cases[i].size, cases[i].pool_stride, cases[i].pool_pad);
+        TEST (same_tensor(p, slow));
+        TEST (fused.size[1] == p.size[1] && fused.size[2] == p.size[2]);
+        TEST (memcmp(fused.data, p.data, tensor_len(p)*sizeof(float)) == 0);
+        tensor_free(im);
+        tensor_free(f);
+        tensor_free(c);
+        tensor_free(a);
+        tensor_free(p);
+        tensor_free(slow);
+        tensor_free(fused);
+    }
+}
+
+void test_mmap()
+{
+    char pa[] = "/tmp/tenswords_mmap_XXXXXX";
+    char pb[] = "/tmp/tenswords_mmap_XXXXXX";
+    char pc[] = "/tmp/tenswords_mmap_XXXXXX";
+    size_t sa[2] = {37, 53};
+    size_t sb[2] = {53, 41};
+    size_t sc[2] = {37, 41};
+    size_t budgets[3] = {0, 4096, 256};
+    size_t i;
+    close(mkstemp(pa));
+    close(mkstemp(pb));
+    close(mkstemp(pc));
+
+    // Created maps write through to the file, reopened ones see the data
+    tensor a = tensor_random(1, 2, sa);
+    tensor b = tensor_random(1, 2, sb);
+    tensor ma = tensor_mmap(pa, 2, sa, 1);
+    tensor mb = tensor_mmap(pb, 2, sb, 1);
+    TEST (ma.data && mb.data);
+    memcpy(ma.data, a.data, tensor_len(a)*sizeof(float));
+    memcpy(mb.data, b.data, tensor_len(b)*sizeof(float));
+    tensor_free(ma);
+    tensor_free(mb);
+    ma = tensor_mmap(pa, 2, sa, 0);
+    mb = tensor_mmap(pb, 2, sb, 0);
+    TEST (memcmp(ma.data, a.data, tensor_len(a)*sizeof(float)) == 0);
+    // Too short a file, or none at all
+    TEST (!tensor_mmap(pa, 2, sb, 0).data);
+    TEST (!tensor_mmap("/tmp/tenswords_mmap_missing/x", 2, sa, 0).data);
+
+    // Copy on write detaches into a heap buffer and leaves the map alone
+    tensor ca = tensor_copy(ma);
+    tensor_mutable(&ca)[0] += 1;
+    TEST (ca.data != ma.data && ma.data[0] == a.data[0]);
+    tensor_free(ca);
+
+    // Default, small and tiny budgets: one tile, ragged tiles and panels
+    tensor ab = matrix_multiply(a, b);
+    for(i = 0; i < 3; ++i){
+        tensor mc = tensor_mmap(pc, 2, sc, 1);
+        matrix_multiply_ooc(ma, mb, &mc, budgets[i]);
+        TEST (memcmp(mc.data, ab.data, tensor_len(ab)*sizeof(float)) == 0);
+        tensor_free(mc);
+    }
+    tensor c = tensor_mmap(pc, 2, sc, 0);
+    TEST (memcmp(c.data, ab.data, tensor_len(ab)*sizeof(float)) == 0);
+    tensor_free(c);
+
+    // In-memory operands work too, and a shared output is detached first
+    c = tensor_make(2, sc);
+    tensor kept = tensor_copy(c);
+    matrix_multiply_ooc(a, b, &c, 1000);
+    TEST (memcmp(c.data, ab.data, tensor_len(ab)*sizeof(float)) == 0);
+    TEST (c.data != kept.data && kept.data[0] == 0);
+    tensor_free(c);
+    tensor_free(kept);
+
+    unlink(pa);
+    unlink(pb);
+    unlink(pc);
+    tensor_free(a);
+    tensor_free(b);
+    tensor_free(ma);
+    tensor_free(mb);
+    tensor_free(ab);
+}
+
+// Worst case rounding of a float dot product summed n adds deep,
+// gamma_n * sum |a_k b_k|, against the sum in double
+static int within_dot_bound(float got, const float *a, const float *b, size_t K, size_t n)
+{
+    double u = FLT_EPSILON/2;
+    double ref = 0, mag = 0;
+    size_t k;
+    for(k = 0; k < K; ++k){
+        ref += (double)a[k]*b[k];
+        mag += fabs((double)a[k]*b[k]);
+    }
+    return fabs(got - ref) <= n*u/(1 - n*u)*mag;
+}
+
+void test_gemv()
+{
+    // Ragged row counts, small and threaded sizes
+    size_t shapes[3][2] = {{13, 7}, {301, 517}, {1, 2000}};
+    size_t i, j;
+    for(i = 0; i < 3; ++i){
+        size_t M = shapes[i][0], K = shapes[i][1];
+        size_t sa[2] = {M, K};
+        size_t sx[2] = {K, 1};
+        size_t sx2[2] = {K, 2};
+        size_t sx2t[2] = {2, K};
+        tensor a = tensor_random(1, 2, sa);
+        tensor x = tensor_random(1, 2, sx);
+        tensor x2 = tensor_random(1, 2, sx2);
+        for(j = 0; j < K; ++j) x2.data[j*2] = x.data[j];
+
+        // Single column products share the lane kernel; the general kernel
+        // sums over k in order, K adds deep, the lanes K/8 + 3 + 7 at most
+        tensor y = matrix_multiply(a, x);
+        tensor g = matrix_gemv(a, x);
+        tensor y2 = matrix_multiply(a, x2);
+        int same = g.n == 1 && g.size[0] == M;
+        int bound = 1;
+        for(j = 0; j < M; ++j){
+            same &= g.data[j] == y.data[j];
+            bound &= within_dot_bound(g.data[j], a.data + j*K, x.data, K, K/8 + 10);
+            bound &= within_dot_bound(y2.data[j*2], a.data + j*K, x.data, K, K);
+        }
+        TEST (same);
+        TEST (bound);
+
+        // x^T a^T takes the vector-matrix path, alone or with 2 rows
+        tensor xt = matrix_transpose(x);
+        tensor at = matrix_transpose(a);
+        tensor xt2 = tensor_random(1, 2, sx2t);
+        memcpy(xt2.data, xt.data, K*sizeof(float));
+        tensor v = matrix_multiply(xt, at);
+        tensor v2 = matrix_multiply(xt2, at);
+        TEST (v.size[0] == 1 && v.size[1] == M);
+        TEST (memcmp(v.data, v2.data, M*sizeof(float)) == 0);
+        int row = 1;
+        for(j = 0; j < M; ++j) row &= within_dot_bound(v.data[j], a.data + j*K, x.data, K, K);
+        TEST (row);
+
+        // Each row of a against the same row of a broadcast x
+        tensor xb = tensor_make(2, sa);
+        for(j = 0; j < M; ++j) memcpy(xb.data + j*K, x.data, K*sizeof(float));
+        tensor d = matrix_batch_dot(a, xb);
+        TEST (memcmp(d.data, g.data, M*sizeof(float)) == 0);
+
+        tensor_free(a);
+        tensor_free(x);
+        tensor_free(x2);
+        tensor_free(y);
+        tensor_free(g);
+        tensor_free(y2);
+        tensor_free(xt);
+        tensor_free(at);
+        tensor_free(xt2);
+        tensor_free(v);
+        tensor_free(v2);
+        tensor_free(xb);
+        tensor_free(d);
+    }
+}
+
 void test()
 {
     test_tensor();
+    test_conv_stream();
+    test_prof();
+    test_conv_algos();
+    test_tune();
+    test_random();
+    test_sparse();
+    test_krylov();
+    test_cow();
+    test_queue();
+    test_conv_plan();
+    test_conv_backward();
+    test_fft();
+    test_norm();
+    test_unary();
+    test_pool();
+    test_mmap();
+    test_gemv();
     printf("%d tests, %d passed, %d failed\n", tests_total, tests_total-tests_fail, tests_fail);
 }
 
@@ -0,0 +1,332 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "tune.h"
+#include "prof.h"
+#include "random.h"
+
+#define TUNE_GEMM 0
+#define TUNE_CONV 1
+#define TUNE_KEYS 8
+// Philox seeds for the benchmark operands, fixed so a search never moves
+// tensor_random's sequence and times the same data every run
+#define TUNE_SEED_A 0x74756e65
+#define TUNE_SEED_B 0x74756e66
+
+typedef struct tune_entry {
+    int kind;
+    size_t key[TUNE_KEYS];
+    size_t val[2];
+} tune_entry;
+
+// Open addressed hash of entry pointers, read without locks on every
+// matrix_multiply and conv2d. Writers hold tune_lock and only ever fill an
+// empty slot or swap in a new entry pointer; growing publishes a bigger copy.
+// Readers may still be looking at a replaced table or entry, so neither is
+// freed; both only grow with the number of tuned shapes.
+typedef struct tune_table {
+    size_t mask;
+    size_t n;
+    struct tune_table *prev;
+    tune_entry *slots[];
+} tune_table;
+
+int tune_enabled = 0;
+static tune_table *tune_current = 0;
+static char tune_cpu[256] = "";
+static char tune_path[1024] = "";
+static pthread_mutex_t tune_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t tune_once = PTHREAD_ONCE_INIT;
+
+const char *tune_cpu_model()
+{
+    if(!*tune_cpu){
+        FILE *fp = fopen("/proc/cpuinfo", "r");
+        char line[512];
+        snprintf(tune_cpu, sizeof(tune_cpu), "unknown");
+        while(fp && fgets(line, sizeof(line), fp)){
+            char *colon = strchr(line, ':');
+            if(strncmp(line, "model name", 10) || !colon) continue;
+            colon += 1 + (colon[1] == ' ');
+            colon[strcspn(colon, "\n")] = 0;
+            snprintf(tune_cpu, sizeof(tune_cpu), "%s", colon);
+            break;
+        }
+        if(fp) fclose(fp);
+    }
+    return tune_cpu;
+}
+
+static size_t tune_hash(int kind, const size_t *key)
+{
+    size_t i;
+    unsigned long long h = 0xcbf29ce484222325ull ^ kind;
+    for(i = 0; i < TUNE_KEYS; ++i){
+        h = (h ^ key[i])*0x100000001b3ull;
+    }
+    return h ^ (h >> 32);
+}
+
+// Slot holding the key, or the empty slot where it would go. The entry seen
+// there comes back through found: a writer may fill the slot right after.
+static size_t tune_slot(const tune_table *t, int kind, const size_t *key, const tune_entry **found)
+{
+    size_t i = tune_hash(kind, key) & t->mask;
+    const tune_entry *e;
+    while((e = __atomic_load_n(&t->slots[i], __ATOMIC_ACQUIRE)) &&
+            (e->kind != kind || memcmp(e->key, key, TUNE_KEYS*sizeof(size_t)))){
+        i = (i + 1) & t->mask;
+    }
+    *found = e;
+    return i;
+}
+
+static tune_table *tune_table_make(size_t cap, tune_table *prev)
+{
+    tune_table *t = calloc(1, sizeof(tune_table) + cap*sizeof(tune_entry *));
+    t->mask = cap - 1;
+    t->prev = prev;
+    return t;
+}
+
+static void tune_publish(tune_table *t)
+{
+    __atomic_store_n(&tune_current, t, __ATOMIC_RELEASE);
+}
+
+// Caller holds tune_lock. Later entries win, so re-tuning a shape just
+// appends to the cache file
+static void tune_insert(tune_entry e)
+{
+    size_t i;
+    const tune_entry *old;
+    tune_table *t = tune_current;
+    tune_entry *p = malloc(sizeof(tune_entry));
+    *p = e;
+    // Keep at least half the slots empty so probes stay short and always end
+    if(2*(t->n + 1) > t->mask + 1){
+        tune_table *g = tune_table_make(2*(t->mask + 1), t);
+        for(i = 0; i <= t->mask; ++i){
+            if(t->slots[i]) g->slots[tune_slot(g, t->slots[i]->kind, t->slots[i]->key, &old)] = t->slots[i];
+        }
+        g->n = t->n;
+        tune_publish(g);
+        t = g;
+    }
+    i = tune_slot(t, e.kind, e.key, &old);
+    if(!old) t->n += 1;
+    __atomic_store_n(&t->slots[i], p, __ATOMIC_RELEASE);
+}
+
+static void tune_init();
+
+static const tune_table *tune_table_get()
+{
+    const tune_table *t = __atomic_load_n(&tune_current, __ATOMIC_ACQUIRE);
+    if(!t){
+        pthread_once(&tune_once, tune_init);
+        t = __atomic_load_n(&tune_current, __ATOMIC_ACQUIRE);
+    }
+    return t;
+}
+
+static int tune_find(int kind, const size_t *key, tune_entry *out)
+{
+    const tune_entry *e;
+    tune_slot(tune_table_get(), kind, key, &e);
+    if(e) *out = *e;
+    return e != 0;
+}
+
+static void tune_load()
+{
+    FILE *fp = fopen(tune_path, "r");
+    char line[1024];
+    const char *cpu = tune_cpu_model();
+    while(fp && fgets(line, sizeof(line), fp)){
+        tune_entry e = {0};
+        size_t *k = e.key;
+        int n = 0;
+        line[strcspn(line, "\n")] = 0;
+        if(sscanf(line, "gemm %zu %zu %zu %zu %zu %n", k, k+1, k+2, e.val, e.val+1, &n) == 5 && n){
+            e.kind = TUNE_GEMM;
+        } else if(sscanf(line, "conv %zu %zu %zu %zu %zu %zu %zu %zu %zu %n",
+                    k, k+1, k+2, k+3, k+4, k+5, k+6, k+7, e.val, &n) == 9 && n){
+            e.kind = TUNE_CONV;
+            if(e.val[0] >= CONV_NALGOS) continue;
+        } else continue;
+        if(strcmp(line + n, cpu)) continue;
+        tune_insert(e);
+    }
+    if(fp) fclose(fp);
+}
+
+static void tune_init()
+{
+    const char *env = getenv("TENSWORDS_TUNE");
+    const char *path = getenv("TENSWORDS_TUNE_CACHE");
+    const char *home = getenv("HOME");
+    if(env && *env && strcmp(env, "0")) tune_enabled = 1;
+    if(path && *path) snprintf(tune_path, sizeof(tune_path), "%s", path);
+    else if(home) snprintf(tune_path, sizeof(tune_path), "%s/.tenswords_tune", home);
+    pthread_mutex_lock(&tune_lock);
+    tune_publish(tune_table_make(16, 0));
+    tune_load();
+    pthread_mutex_unlock(&tune_lock);
+}
+
+static void tune_record(tune_entry e)
+{
+    size_t i;
+    pthread_mutex_lock(&tune_lock);
+    tune_insert(e);
+    FILE *fp = *tune_path ? fopen(tune_path, "a") : 0;
+    if(fp){
+        if(e.kind == TUNE_GEMM){
+            fprintf(fp, "gemm %zu %zu %zu %zu %zu ", e.key[0], e.key[1], e.key[2], e.val[0], e.val[1]);
+        } else {
+            fprintf(fp, "conv");
+            for(i = 0; i < TUNE_KEYS; ++i) fprintf(fp, " %zu", e.key[i]);
+            fprintf(fp, " %zu ", e.val[0]);
+        }
+        fprintf(fp, "%s\n", tune_cpu_model());
+        fclose(fp);
+    }
+    pthread_mutex_unlock(&tune_lock);
+}
+
+void tune_enable(int on)
+{
+    pthread_once(&tune_once, tune_init);
+    tune_enabled = on;
+}
+
+// Switches to another cache file, dropping what was loaded from the old one
+int tune_set_cache(const char *path)
+{
+    pthread_once(&tune_once, tune_init);
+    pthread_mutex_lock(&tune_lock);
+    snprintf(tune_path, sizeof(tune_path), "%s", path ? path : "");
+    tune_publish(tune_table_make(16, tune_current));
+    if(*tune_path) tune_load();
+    size_t n = tune_current->n;
+    pthread_mutex_unlock(&tune_lock);
+    return n;
+}
+
+gemm_config tune_gemm_default(size_t M, size_t K, size_t N)
+{
+    // Keep a 128 x 512 panel of b (256KB) resident while sweeping rows of a
+    gemm_config cfg = {128, 512};
+    if(cfg.bk >= K) cfg.bk = 0;
+    if(cfg.bn >= N) cfg.bn = 0;
+    return cfg;
+}
+
+// Best of a few runs, fewer when a single run is already slow
+static double tune_time(int gemm, const tensor *args, gemm_config cfg, conv_algo algo, size_t stride, size_t pad)
+{
+    double best = 0;
+    size_t i;
+    for(i = 0; i < 3; ++i){
+        double start = prof_now();
+        tensor t = gemm ? matrix_multiply_config(args[0], args[1], cfg)
+                        : conv2d_algo(args[0], args[1], stride, pad, algo);
+        double elapsed = prof_now() - start;
+        tensor_free(t);
+        if(i == 0 || elapsed < best) best = elapsed;
+        if(elapsed > .5) break;
+    }
+    return best;
+}
+
+gemm_config tune_gemm_search(size_t M, size_t K, size_t N)
+{
+    size_t bks[] = {0, 32, 64, 128, 256, 512};
+    size_t bns[] = {0, 128, 256, 512, 1024, 2048};
+    size_t sa[2] = {M, K};
+    size_t sb[2] = {K, N};
+    tensor args[2] = {tensor_random_uniform(TUNE_SEED_A, -1, 1, 2, sa), tensor_random_uniform(TUNE_SEED_B, -1, 1, 2, sb)};
+    gemm_config best = tune_gemm_default(M, K, N);
+    double best_time = tune_time(1, args, best, 0, 0, 0);
+    size_t i, j;
+    for(i = 0; i < sizeof(bks)/sizeof(bks[0]); ++i){
+        for(j = 0; j < sizeof(bns)/sizeof(bns[0]); ++j){
+            // Blocks at least as big as the matrix are the same as no blocking
+            if((bks[i] >= K) || (bns[j] >= N)) continue;
+            gemm_config cfg = {bks[i], bns[j]};
+            double t = tune_time(1, args, cfg, 0, 0, 0);
+            if(t < best_time){
+                best_time = t;
+                best = cfg;
+            }
+        }
+    }
+    tensor_free(args[0]);
+    tensor_free(args[1]);
+
+    tune_entry e = {TUNE_GEMM, {M, K, N}, {best.bk, best.bn}};
+    tune_record(e);
+    return best;
+}
+
+gemm_config tune_gemm(size_t M, size_t K, size_t N)
+{
+    tune_entry e;
+    size_t key[TUNE_KEYS] = {M, K, N};
+    if(tune_find(TUNE_GEMM, key, &e)){
+        gemm_config cfg = {e.val[0], e.val[1]};
+        return cfg;
+    }
+    if(tune_enabled) return tune_gemm_search(M, K, N);
+    return tune_gemm_default(M, K, N);
+}
+
+conv_algo tune_conv2d_default(const size_t *im_size, const size_t *f_size, size_t stride, size_t pad)
+{
+    if(conv2d_algo_supported(CONV_1X1, f_size, stride, pad)) return CONV_1X1;
+    if(conv2d_algo_supported(CONV_FFT, f_size, stride, pad) &&
+            conv2d_algo_cost(CONV_FFT, im_size, f_size, stride, pad) <
+            conv2d_algo_cost(CONV_IM2COL, im_size, f_size, stride, pad)) return CONV_FFT;
+    return CONV_IM2COL;
+}
+
+conv_algo tune_conv2d_search(const size_t *im_size, const size_t *f_size, size_t stride, size_t pad)
+{
+    tensor args[2] = {tensor_random_uniform(TUNE_SEED_A, -1, 1, 3, im_size),
+        tensor_random_uniform(TUNE_SEED_B, -1, 1, 4, f_size)};
+    conv_algo best = tune_conv2d_default(im_size, f_size, stride, pad);
+    int algo;
+    // One untimed run of every candidate first, so a GEMM search it sets off
+    // through tune_gemm is not billed to whichever algorithm hits it first
+    for(algo = 0; tune_enabled && algo < CONV_NALGOS; ++algo){
+        if(conv2d_algo_supported(algo, f_size, stride, pad)) tensor_free(conv2d_algo(args[0], args[1], stride, pad, algo));
+    }
+    double best_time = tune_time(0, args, (gemm_config){0}, best, stride, pad);
+    for(algo = 0; algo < CONV_NALGOS; ++algo){
+        if(algo == best || !conv2d_algo_supported(algo, f_size, stride, pad)) continue;
+        double t = tune_time(0, args, (gemm_config){0}, algo, stride, pad);
+        if(t < best_time){
+            best_time = t;
+            best = algo;
+        }
+    }
+    tensor_free(args[0]);
+    tensor_free(args[1]);
+
+    tune_entry e = {TUNE_CONV, {im_size[0], im_size[1], im_size[2],
+        f_size[0], f_size[2], f_size[3], stride, pad}, {best}};
+    tune_record(e);
+    return best;
+}
+
+conv_algo tune_conv2d(const size_t *im_size, const size_t *f_size, size_t stride, size_t pad)
+{
+    tune_entry e;
+    size_t key[TUNE_KEYS] = {im_size[0], im_size[1], im_size[2],
+        f_size[0], f_size[2], f_size[3], stride, pad};
+    if(tune_find(TUNE_CONV, key, &e)) return e.val[0];
+    if(tune_enabled) return tune_conv2d_search(im_size, f_size, stride, pad);
+    return tune_conv2d_default(im_size, f_size, stride, pad);
+}
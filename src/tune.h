@@ -0,0 +1,38 @@
+// Include guards and C++ compatibility
+#ifndef TUNE_H
+#define TUNE_H
+#include "tensor.h"
+#include "matrix.h"
+#include "conv.h"
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Per-shape choice of GEMM blocking and conv2d algorithm.
+// matrix_multiply and conv2d ask tune_gemm and tune_conv2d for every call.
+// Those return the cached winner for the shape on this CPU model, or a
+// heuristic default when there is none. With tuning enabled (tune_enable(1)
+// or TENSWORDS_TUNE=1) a miss times every candidate instead, and the winner
+// is appended to the cache file: TENSWORDS_TUNE_CACHE, else ~/.tenswords_tune.
+// Entries for other CPU models in the same file are kept but ignored.
+// Lookups take no lock; only recording a new winner or switching the cache
+// file does.
+
+extern int tune_enabled;
+
+void tune_enable(int on);
+int tune_set_cache(const char *path);
+const char *tune_cpu_model();
+
+gemm_config tune_gemm(size_t M, size_t K, size_t N);
+gemm_config tune_gemm_default(size_t M, size_t K, size_t N);
+gemm_config tune_gemm_search(size_t M, size_t K, size_t N);
+
+conv_algo tune_conv2d(const size_t *im_size, const size_t *f_size, size_t stride, size_t pad);
+conv_algo tune_conv2d_default(const size_t *im_size, const size_t *f_size, size_t stride, size_t pad);
+conv_algo tune_conv2d_search(const size_t *im_size, const size_t *f_size, size_t stride, size_t pad);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
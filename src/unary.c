@@ -0,0 +1,122 @@
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+#include "unary.h"
+#include "fastmath.h"
+#include "prof.h"
+
+#define MIN(a,b) (((a)<(b))?(a):(b))
+
+// Elements per parallel work item, and the smallest tensor worth threads
+#define UNARY_BLOCK 4096
+#define UNARY_PARALLEL_MIN (16*UNARY_BLOCK)
+
+// The switch sits outside the loops so each one inlines its kernel and
+// vectorizes. x and y may be the same array.
+static void unary_block_(const float *x, float *y, size_t n, unary_op op)
+{
+    size_t i;
+    switch(op){
+        case UNARY_EXP:
+            for(i = 0; i < n; ++i) y[i] = simd_expf(x[i]);
+            break;
+        case UNARY_LOG:
+            for(i = 0; i < n; ++i) y[i] = simd_logf(x[i]);
+            break;
+        case UNARY_SQRT:
+            for(i = 0; i < n; ++i) y[i] = sqrtf(x[i]);
+            break;
+        case UNARY_TANH:
+            for(i = 0; i < n; ++i) y[i] = simd_tanhf(x[i]);
+            break;
+        case UNARY_SIGMOID:
+            for(i = 0; i < n; ++i) y[i] = simd_sigmoidf(x[i]);
+            break;
+        case UNARY_GELU:
+            for(i = 0; i < n; ++i) y[i] = simd_geluf(x[i]);
+            break;
+        case UNARY_RELU:
+            for(i = 0; i < n; ++i) y[i] = x[i] > 0 ? x[i] : 0;
+            break;
+        case UNARY_IDENTITY:
+            if(x != y) memcpy(y, x, n*sizeof(float));
+            break;
+        default:
+            assert(0);
+    }
+}
+
+void unary_apply(const float *x, float *y, size_t len, unary_op op)
+{
+    size_t nblocks = (len + UNARY_BLOCK - 1)/UNARY_BLOCK;
+    size_t b;
+    #pragma omp parallel for schedule(static) if(len >= UNARY_PARALLEL_MIN)
+    for(b = 0; b < nblocks; ++b){
+        size_t i = b*UNARY_BLOCK;
+        unary_block_(x + i, y + i, MIN(UNARY_BLOCK, len - i), op);
+    }
+}
+
+void tensor_unary_into(tensor t, unary_op op, tensor *out)
+{
+    size_t len = tensor_len(t);
+    assert(tensor_len(*out) == len);
+    PROF_BEGIN(start);
+    float *y = tensor_mutable(out);
+    unary_apply(t.data, y, len, op);
+    PROF_END(PROF_UNARY, start, len);
+}
+
+void tensor_unary_inplace(tensor *t, unary_op op)
+{
+    size_t len = tensor_len(*t);
+    PROF_BEGIN(start);
+    float *y = tensor_mutable(t);
+    unary_apply(y, y, len, op);
+    PROF_END(PROF_UNARY, start, len);
+}
+
+tensor tensor_unary(tensor t, unary_op op)
+{
+    size_t len = tensor_len(t);
+    PROF_BEGIN(start);
+    tensor r = tensor_make(t.n, t.size);
+    unary_apply(t.data, r.data, len, op);
+    PROF_END(PROF_UNARY, start, len);
+    return r;
+}
+
+tensor tensor_exp(tensor t)
+{
+    return tensor_unary(t, UNARY_EXP);
+}
+
+tensor tensor_log(tensor t)
+{
+    return tensor_unary(t, UNARY_LOG);
+}
+
+tensor tensor_sqrt(tensor t)
+{
+    return tensor_unary(t, UNARY_SQRT);
+}
+
+tensor tensor_tanh(tensor t)
+{
+    return tensor_unary(t, UNARY_TANH);
+}
+
+tensor tensor_sigmoid(tensor t)
+{
+    return tensor_unary(t, UNARY_SIGMOID);
+}
+
+tensor tensor_gelu(tensor t)
+{
+    return tensor_unary(t, UNARY_GELU);
+}
+
+tensor tensor_relu(tensor t)
+{
+    return tensor_unary(t, UNARY_RELU);
+}
@@ -0,0 +1,52 @@
+// Include guards and C++ compatibility
+#ifndef UNARY_H
+#define UNARY_H
+#include "tensor.h"
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Elementwise activations and transcendentals. Each op is one tight loop
+// over a fastmath.h kernel that the compiler vectorizes, large tensors are
+// split into blocks across threads. In the default -Ofast build on x86-64
+// glibc, exp, log and (glibc 2.35 and later) tanh are glibc's libmvec
+// vector functions, within 3, 4 and 1.5 ulp; sigmoid and gelu build on that
+// exp, since it measured faster there (numbers in fastmath.h). Other
+// targets, or -DFASTMATH_LIBMVEC=0, fall back to the fastmath.h
+// polynomials with the bounds listed there. FASTMATH_*_ULP give the bound of
+// the version compiled in. sqrt is within 3 ulp (a reciprocal square root
+// estimate and a Newton step under -Ofast) and relu is exact.
+
+typedef enum {
+    UNARY_EXP,
+    UNARY_LOG,
+    UNARY_SQRT,
+    UNARY_TANH,
+    UNARY_SIGMOID,
+    UNARY_GELU,     // tanh approximation
+    UNARY_RELU,
+    UNARY_IDENTITY,
+    UNARY_NOPS
+} unary_op;
+
+tensor tensor_unary(tensor t, unary_op op);
+// Raw array version for kernels that fuse an activation into their own
+// loops. x and y may be the same array.
+void unary_apply(const float *x, float *y, size_t len, unary_op op);
+// Writes through tensor_mutable, so a shared buffer is copied first
+void tensor_unary_inplace(tensor *t, unary_op op);
+// out must have as many elements as t and may share its buffer
+void tensor_unary_into(tensor t, unary_op op, tensor *out);
+
+tensor tensor_exp(tensor t);
+tensor tensor_log(tensor t);
+tensor tensor_sqrt(tensor t);
+tensor tensor_tanh(tensor t);
+tensor tensor_sigmoid(tensor t);
+tensor tensor_gelu(tensor t);
+tensor tensor_relu(tensor t);
+
+#ifdef __cplusplus
+}
+#endif
+#endif